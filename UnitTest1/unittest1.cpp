@@ -1,8 +1,15 @@
 ﻿#include "stdafx.h"
 #include "CppUnitTest.h"
 #include <sstream>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <filesystem>
 #include "../include/pckfile.h"
 #include "../include/pckitem.h"
+#include "../include/pckreader.h"
 #include "../include/pckfile_c.h"
 #include "../src/stringhelper.h"
 #include "../include/pcktree.h"
@@ -17,6 +24,39 @@ namespace UnitTest1
 		system("copy /y test.pck test2.pck");
 	}
 
+	// 测试用的文件内容，按seed生成伪随机内容，压缩后大约是原来的一半
+	static string MakeContent(int seed, int size)
+	{
+		string s;
+		uint32_t x = seed;
+		for (int i = 0; i < size; ++i)
+		{
+			x = x * 1103515245 + 12345;
+			s.push_back("0123456789abcdef"[(x >> 16) % 16]);
+		}
+		return s;
+	}
+
+	// 添加文件，同时把内容记录到files中
+	static void AddContent(PckFile& pck, map<string, string>& files, const string& name, int seed, int size)
+	{
+		files[name] = MakeContent(seed, size);
+		pck.AddItem(files[name].data(), (uint32_t)files[name].size(), name);
+	}
+
+	// 按指定的选项重新打开文件包，检查文件数、按名称查找和每个文件的内容
+	static void CheckFiles(const char* filename, const map<string, string>& files, const PckFile::OpenOptions& options = PckFile::OpenOptions())
+	{
+		auto pck = PckFile::Open(filename, options);
+		Assert::IsTrue(pck->GetFileCount() == files.size());
+		for (auto& [name, content] : files)
+		{
+			Assert::IsTrue(pck->FileExists(name));
+			auto data = pck->GetSingleFileData(name);
+			Assert::IsTrue(string(data.begin(), data.end()) == content);
+		}
+	}
+
 	TEST_CLASS(Pck核心功能)
 	{
 		shared_ptr<PckFile> pck;
@@ -80,6 +120,14 @@ namespace UnitTest1
 			Assert::IsTrue(pck->FileExists("abc\\123.txt"));
 			Assert::IsFalse(pck->FileExists("xxxxx"));
 		}
+
+		TEST_METHOD(文件是否存在_不区分大小写)
+		{
+			Assert::IsTrue(pck->FileExists("ABC/123.TXT"));
+			auto& item1 = pck->GetSingleFileItem("abc\\123.txt");
+			auto& item2 = (*pck)["Abc/123.Txt"];
+			Assert::IsTrue(&item1 == &item2);
+		}
 	};
 
 	TEST_CLASS(新建PCK)
@@ -136,6 +184,809 @@ namespace UnitTest1
 		{
 			pck->DeleteItem((*pck)["abc/del.txt"]);
 		}
+
+		TEST_METHOD(删除后取消提交)
+		{
+			map<string, string> files;
+			{
+				auto p = PckFile::Create("cancel.pck", true);
+				p->BeginTransaction();
+				AddContent(*p, files, "cancel/a.txt", 1, 3000);
+				AddContent(*p, files, "cancel/b.txt", 2, 3000);
+				AddContent(*p, files, "cancel/c.txt", 3, 3000);
+				p->CommitTransaction();
+			}
+			auto p = PckFile::Open("cancel.pck", false);
+			p->BeginTransaction();
+			p->DeleteItem((*p)["cancel/a.txt"]);
+			p->AddItem("ddd", 3, "cancel/d.txt");
+			// 处理完删除操作后取消，已经处理的删除仍然生效，不会留下释放了空间却还在索引中的文件
+			Assert::ExpectException<std::runtime_error>([&]() {
+				p->CommitTransaction([](uint32_t i, uint32_t) { return i < 1; });
+			});
+			files.erase("cancel/a.txt");
+			Assert::IsTrue(p->size() == 2);
+			Assert::IsFalse(p->FileExists("cancel/a.txt"));
+			Assert::IsFalse(p->FileExists("cancel/d.txt"));
+
+			// 之后的文件会复用a.txt释放的空间
+			p->BeginTransaction();
+			AddContent(*p, files, "cancel/e.txt", 5, 1000);
+			p->CommitTransaction();
+			p.reset();
+			CheckFiles("cancel.pck", files);
+		}
+
+		// 重命名目录的测试文件包：dir和前缀相同的dirx，dir下有子目录，other下有一个与dir下同名的文件
+		static map<string, string> MakeRenamePck(const char* filename)
+		{
+			map<string, string> files;
+			auto p = PckFile::Create(filename, true);
+			p->BeginTransaction();
+			AddContent(*p, files, "dir\\a.txt", 1, 500);
+			AddContent(*p, files, "dir\\b.txt", 2, 500);
+			AddContent(*p, files, "dir\\sub\\a.txt", 3, 500);
+			AddContent(*p, files, "dirx\\a.txt", 4, 500);
+			AddContent(*p, files, "other\\b.txt", 5, 500);
+			p->CommitTransaction();
+			return files;
+		}
+
+		// 把files中old目录下的文件移到new目录下
+		static void RenameInMap(map<string, string>& files, const string& olddir, const string& newdir)
+		{
+			map<string, string> result;
+			for (auto& [name, content] : files)
+			{
+				if (name.compare(0, olddir.size() + 1, olddir + "\\") == 0)
+					result[newdir + name.substr(olddir.size())] = content;
+				else
+					result[name] = content;
+			}
+			files.swap(result);
+		}
+
+		TEST_METHOD(重命名目录)
+		{
+			auto files = MakeRenamePck("renamedir.pck");
+			{
+				auto p = PckFile::Open("renamedir.pck", false);
+				// 只匹配完整的目录名，dirx下的文件不受影响
+				Assert::AreEqual(3, p->RenameDirectory("DIR", "new/dir"));
+				RenameInMap(files, "dir", "new\\dir");
+				Assert::IsTrue(p->FileExists("dirx/a.txt"));
+				Assert::IsFalse(p->FileExists("dir/a.txt"));
+				Assert::IsTrue(p->FileExists("new/dir/sub/a.txt"));
+				// 不存在的目录
+				Assert::AreEqual(0, p->RenameDirectory("nothing", "x"));
+			}
+			CheckFiles("renamedir.pck", files);
+		}
+
+		TEST_METHOD(重命名目录_冲突时不做任何修改)
+		{
+			auto files = MakeRenamePck("renamedir.pck");
+			{
+				auto p = PckFile::Open("renamedir.pck", false);
+				auto size = p->GetFileSize();
+				// dir\b.txt会与other\b.txt冲突，dir\sub\a.txt会与不在dir\sub下的dir\a.txt冲突
+				Assert::ExpectException<std::runtime_error>([&]() { p->RenameDirectory("dir", "other"); });
+				Assert::ExpectException<std::runtime_error>([&]() { p->RenameDirectory("dir/sub", "dir"); });
+				Assert::IsTrue(p->GetFileSize() == size);
+				Assert::IsTrue(p->FileExists("dir/a.txt"));
+				Assert::IsTrue(p->FileExists("dir/sub/a.txt"));
+				Assert::IsFalse(p->FileExists("other/a.txt"));
+			}
+			CheckFiles("renamedir.pck", files);
+		}
+
+		TEST_METHOD(重命名目录_移到自身的子目录)
+		{
+			auto files = MakeRenamePck("renamedir.pck");
+			{
+				auto p = PckFile::Open("renamedir.pck", false);
+				// dir\a.txt移到已存在的dir\sub\a.txt，后者同时移到dir\sub\sub\a.txt，不算冲突
+				Assert::AreEqual(3, p->RenameDirectory("dir", "dir/sub"));
+				RenameInMap(files, "dir", "dir\\sub");
+				Assert::IsTrue(p->GetFileCount() == files.size());
+				for (auto& [name, content] : files)
+				{
+					auto data = p->GetSingleFileData(name);
+					Assert::IsTrue(string(data.begin(), data.end()) == content);
+				}
+			}
+			CheckFiles("renamedir.pck", files);
+		}
+
+		TEST_METHOD(重命名目录_在事务中)
+		{
+			auto files = MakeRenamePck("renamedir.pck");
+			{
+				auto p = PckFile::Open("renamedir.pck", false);
+				auto count = p->GetFileCount();
+				p->BeginTransaction();
+				AddContent(*p, files, "added.txt", 6, 500);
+				Assert::AreEqual(3, p->RenameDirectory("dir", "moved"));
+				RenameInMap(files, "dir", "moved");
+				Assert::AreEqual(1, p->RenameDirectory("other", "moved2"));
+				RenameInMap(files, "other", "moved2");
+				// 事务中不提交，提交之前文件包不变
+				Assert::IsTrue(p->GetFileCount() == count);
+				Assert::IsTrue(p->FileExists("dir/a.txt"));
+				p->CommitTransaction();
+				Assert::IsFalse(p->FileExists("dir/a.txt"));
+				Assert::IsTrue(p->FileExists("moved/sub/a.txt"));
+			}
+			CheckFiles("renamedir.pck", files);
+		}
+	};
+
+	TEST_CLASS(读取)
+	{
+		map<string, string> files;
+
+		// 按请求的顺序检查读取结果
+		void CheckResults(const vector<const PckItem*>& items, const vector<vector<uint8_t>>& results)
+		{
+			Assert::IsTrue(results.size() == items.size());
+			for (size_t i = 0; i < items.size(); ++i)
+			{
+				Assert::IsTrue(string(results[i].begin(), results[i].end()) == files[items[i]->GetFileName()]);
+			}
+		}
+
+	public:
+		读取()
+		{
+			// 大量相邻的小文件、几个大文件和一个空文件
+			auto pck = PckFile::Create("read.pck", true);
+			pck->BeginTransaction();
+			for (int i = 0; i < 300; ++i)
+			{
+				AddContent(*pck, files, "read\\small\\" + to_string(i) + ".txt", i + 1, 100 + i * 7);
+			}
+			for (int i = 0; i < 3; ++i)
+			{
+				AddContent(*pck, files, "read\\big\\" + to_string(i) + ".bin", 1000 + i, 300000);
+			}
+			AddContent(*pck, files, "read\\empty.txt", 1, 0);
+			// 不压缩，直接保存原始数据
+			PckFile::CompressPolicy raw;
+			raw.level = 0;
+			files["read\\raw.bin"] = MakeContent(2000, 100000);
+			pck->AddItem(files["read\\raw.bin"].data(), (uint32_t)files["read\\raw.bin"].size(), "read\\raw.bin", raw);
+			pck->CommitTransaction();
+		}
+
+		TEST_METHOD(数据缓存)
+		{
+			filesystem::copy_file("read.pck", "datacache.pck", filesystem::copy_options::overwrite_existing);
+			{
+				PckFile::OpenOptions options;
+				options.readonly = false;
+				options.datacache = 4 * 1024 * 1024;
+				auto pck = PckFile::Open("datacache.pck", options);
+				auto stats = pck->GetDataCacheStats();
+				Assert::IsTrue(stats.capacity == options.datacache && stats.count == 0);
+
+				// 第一次读取未命中，之后命中，共享的数据是同一份
+				const char* name = "read\\small\\0.txt";
+				auto a = pck->GetSingleFileDataShared((*pck)[name]);
+				auto b = pck->GetSingleFileDataShared((*pck)[name]);
+				Assert::IsTrue(a == b);
+				Assert::IsTrue(string(a->begin(), a->end()) == files[name]);
+				auto data = pck->GetSingleFileData(name);
+				Assert::IsTrue(string(data.begin(), data.end()) == files[name]);
+				stats = pck->GetDataCacheStats();
+				Assert::IsTrue(stats.misses == 1 && stats.hits == 2 && stats.count == 1);
+
+				// 预读整个目录，之后读取目录下的文件全部命中
+				Assert::AreEqual(300u, pck->WarmDataCache("READ/small"));
+				stats = pck->GetDataCacheStats();
+				Assert::IsTrue(stats.count == 300 && stats.bytes <= stats.capacity);
+				auto misses = stats.misses;
+				for (int i = 0; i < 300; ++i)
+				{
+					auto filename = "read\\small\\" + to_string(i) + ".txt";
+					data = pck->GetSingleFileData(filename);
+					Assert::IsTrue(string(data.begin(), data.end()) == files[filename]);
+				}
+				Assert::IsTrue(pck->GetDataCacheStats().misses == misses);
+
+				// 更新后缓存中的旧数据失效
+				files[name] = MakeContent(77, 1234);
+				pck->UpdateItem((*pck)[name], files[name].data(), (uint32_t)files[name].size());
+				data = pck->GetSingleFileData(name);
+				Assert::IsTrue(string(data.begin(), data.end()) == files[name]);
+				Assert::IsTrue(pck->GetDataCacheStats().misses == misses + 1);
+
+				// 缓存容量小于目录中的数据量时，只预读能放下的部分
+				pck->SetDataCacheCapacity(100000);
+				auto count = pck->WarmDataCache("read/small");
+				Assert::IsTrue(count > 0 && count < 300);
+				stats = pck->GetDataCacheStats();
+				Assert::IsTrue(stats.bytes <= 100000);
+			}
+			CheckFiles("datacache.pck", files);
+		}
+
+		TEST_METHOD(流式读取)
+		{
+			auto pck = PckFile::Open("read.pck");
+			for (auto name : { "read\\big\\0.bin", "read\\small\\10.txt", "read\\empty.txt", "read\\raw.bin" })
+			{
+				auto& item = (*pck)[name];
+				auto& content = files[name];
+				// 缓冲区很小，需要多次读取和解压
+				PckItemReader reader(*pck, item, 1000);
+				Assert::IsTrue(reader.Size() == content.size());
+				string data;
+				char buf[777];
+				while (size_t n = reader.Read(buf, sizeof(buf)))
+				{
+					data.append(buf, n);
+					Assert::IsTrue(reader.Tell() == data.size());
+				}
+				Assert::IsTrue(reader.Eof());
+				Assert::IsTrue(data == content);
+
+				PckItemIStream stream(*pck, item);
+				stringstream ss;
+				if (!content.empty())
+				{
+					ss << stream.rdbuf();
+				}
+				Assert::IsTrue(ss.str() == content);
+				Assert::IsFalse(stream.bad());
+			}
+		}
+
+		TEST_METHOD(批量读取)
+		{
+			for (bool mmap : { false, true })
+			{
+				PckFile::OpenOptions options;
+				options.mmap = mmap;
+				auto pck = PckFile::Open("read.pck", options);
+				// 打乱顺序请求，结果仍按请求的顺序返回
+				vector<const PckItem*> items;
+				for (auto& item : *pck)
+				{
+					items.push_back(&item);
+				}
+				reverse(items.begin(), items.end());
+				swap(items[3], items[200]);
+				for (auto& item : items)
+				{
+					auto data = pck->GetSingleFileData(*item);
+					Assert::IsTrue(string(data.begin(), data.end()) == files[item->GetFileName()]);
+				}
+
+				CheckResults(items, pck->ReadBatch(items));
+				PckFile::BatchOptions nogap;
+				nogap.maxgap = 0;
+				CheckResults(items, pck->ReadBatch(items, nogap));
+				PckFile::BatchOptions small;
+				small.maxread = 4096;
+				CheckResults(items, pck->ReadBatch(items, small));
+
+				// sink按请求的顺序调用
+				size_t next = 0;
+				pck->ReadBatch(items, [&](size_t index, const PckItem& item, vector<uint8_t>& data) {
+					Assert::IsTrue(index == next++);
+					Assert::IsTrue(&item == items[index]);
+					Assert::IsTrue(string(data.begin(), data.end()) == files[item.GetFileName()]);
+				});
+				Assert::IsTrue(next == items.size());
+			}
+		}
+
+		TEST_METHOD(异步读取)
+		{
+			// Linux中使用io_uring，其他系统和io_uring不可用时使用线程池，内存映射时直接解压
+			for (bool mmap : { false, true })
+			{
+				PckFile::OpenOptions options;
+				options.mmap = mmap;
+				auto pck = PckFile::Open("read.pck", options);
+
+				// 一次提交全部文件，超过同时进行的读取数上限
+				mutex m;
+				condition_variable cond;
+				size_t count = 0;
+				map<string, string> results;
+				bool failed = false;
+				for (auto& item : *pck)
+				{
+					pck->ReadAsync(item, [&](const PckItem& readitem, vector<uint8_t>& data, exception_ptr error) {
+						lock_guard<mutex> lock(m);
+						failed = failed || error;
+						results[readitem.GetFileName()].assign(data.begin(), data.end());
+						++count;
+						cond.notify_all();
+					});
+				}
+				{
+					unique_lock<mutex> lock(m);
+					cond.wait(lock, [&] { return count == pck->size(); });
+				}
+				Assert::IsFalse(failed);
+				Assert::IsTrue(results == files);
+
+				vector<future<vector<uint8_t>>> futures;
+				for (auto& item : *pck)
+				{
+					futures.push_back(pck->ReadAsync(item));
+				}
+				size_t i = 0;
+				for (auto& item : *pck)
+				{
+					auto data = futures[i++].get();
+					auto expect = pck->GetSingleFileData(item);
+					Assert::IsTrue(data == expect);
+					Assert::IsTrue(string(data.begin(), data.end()) == files[item.GetFileName()]);
+				}
+			}
+		}
+	};
+
+	TEST_CLASS(访问记录)
+	{
+	public:
+		TEST_METHOD(按访问顺序重建)
+		{
+			map<string, string> files;
+			{
+				auto pck = PckFile::Create("trace.pck", true);
+				pck->BeginTransaction();
+				for (auto dir : { "a", "b", "c" })
+				{
+					for (int i = 0; i < 5; ++i)
+					{
+						AddContent(*pck, files, string(dir) + "\\" + to_string(i) + ".txt", (int)files.size() + 1, 1000);
+					}
+				}
+				pck->CommitTransaction();
+			}
+			{
+				auto pck = PckFile::Open("trace.pck");
+				pck->GetSingleFileData("b/0.txt");
+				pck->StartAccessTrace();
+				pck->GetSingleFileData("C/3.txt");
+				pck->GetSingleFileData("a/1.txt");
+				// 重复读取只记录第一次
+				pck->GetSingleFileData("c/3.txt");
+				pck->ReadBatch({ &(*pck)["b/2.txt"], &(*pck)["a/1.txt"] });
+				pck->StopAccessTrace();
+				pck->GetSingleFileData("a/4.txt");
+				pck->SaveAccessTrace("trace.trace");
+			}
+			PckFile::ReBuildWithTrace("trace.pck", "trace2.pck", "trace.trace", true);
+			CheckFiles("trace2.pck", files);
+
+			// 重建后索引顺序就是数据顺序：先是记录中的文件，其余的文件按目录分组排在后面
+			auto pck = PckFile::Open("trace2.pck");
+			Assert::AreEqual("c\\3.txt", pck->GetSingleFileItem(0u).GetFileName());
+			Assert::AreEqual("a\\1.txt", pck->GetSingleFileItem(1u).GetFileName());
+			Assert::AreEqual("b\\2.txt", pck->GetSingleFileItem(2u).GetFileName());
+			string dirs;
+			for (uint32_t i = 3; i < pck->GetFileCount(); ++i)
+			{
+				auto dir = pck->GetSingleFileItem(i).GetFileName()[0];
+				if (dirs.empty() || dirs.back() != dir)
+				{
+					dirs.push_back(dir);
+				}
+			}
+			Assert::IsTrue(dirs.size() == 3);
+		}
+	};
+
+	TEST_CLASS(压缩策略)
+	{
+		// 几乎无法压缩的数据
+		static string MakeRandom(int seed, int size)
+		{
+			string s;
+			uint32_t x = seed;
+			for (int i = 0; i < size; ++i)
+			{
+				x = x * 1103515245 + 12345;
+				s.push_back((char)(x >> 16));
+			}
+			return s;
+		}
+
+	public:
+		TEST_METHOD(按策略压缩或保存原始数据)
+		{
+			PckFile::CompressPolicy policy;
+			policy.extlevels = { { "ogg", 0 }, { "txt", 9 } };
+			policy.threshold = 0.9;
+			policy.probesize = 4096;
+			PckFile::CompressPolicy raw;
+			raw.level = 0;
+
+			map<string, string> files;
+			files["p\\a.txt"] = MakeContent(1, 20000);		// 压缩
+			files["p\\b.OGG"] = MakeContent(2, 20000);		// 按扩展名不压缩
+			files["p\\c.bin"] = MakeRandom(3, 50000);		// 试压缩效果太差，不压缩
+			files["p\\d.dat"] = MakeRandom(4, 5000);		// 太小不试压缩，压缩后效果太差
+			files["p\\e.txt"] = "tiny";				// 太小不压缩
+			files["p\\f.dat"] = MakeContent(6, 20000);		// 添加时指定的策略优先
+			{
+				auto pck = PckFile::Create("policy.pck", true);
+				pck->BeginTransaction();
+				for (auto& [name, content] : files)
+				{
+					if (name == "p\\f.dat")
+						pck->AddItem(content.data(), (uint32_t)content.size(), name, raw);
+					else
+						pck->AddItem(content.data(), (uint32_t)content.size(), name);
+				}
+				pck->CommitTransaction({}, policy);
+
+				auto report = pck->GetCompressReport();
+				Assert::IsTrue(report.compressed == 1);
+				Assert::IsTrue(report.stored == 5);
+				Assert::IsTrue(report.probed == 1);
+				uint64_t databytes = 0, writtenbytes = 0;
+				for (auto& item : *pck)
+				{
+					databytes += item.GetDataSize();
+					writtenbytes += item.GetCompressDataSize();
+					// 只有a.txt保存压缩数据
+					bool compressed = string(item.GetFileName()) == "p\\a.txt";
+					Assert::IsTrue(compressed == (item.GetCompressDataSize() < item.GetDataSize()));
+				}
+				Assert::IsTrue(report.databytes == databytes);
+				Assert::IsTrue(report.writtenbytes == writtenbytes);
+			}
+			CheckFiles("policy.pck", files);
+
+			// 更新同样按策略处理，保存原始数据的文件更新后可以重新压缩
+			{
+				auto pck = PckFile::Open("policy.pck", false);
+				pck->BeginTransaction();
+				files["p\\c.bin"] = MakeContent(7, 50000);
+				pck->UpdateItem((*pck)["p\\c.bin"], files["p\\c.bin"].data(), (uint32_t)files["p\\c.bin"].size());
+				pck->CommitTransaction({}, policy);
+				Assert::IsTrue(pck->GetCompressReport().compressed == 1);
+				Assert::IsTrue((*pck)["p\\c.bin"].GetCompressDataSize() < 50000);
+			}
+			CheckFiles("policy.pck", files);
+		}
+	};
+
+	TEST_CLASS(内容去重)
+	{
+		PckFile::CompressPolicy policy;
+		string a, b;
+
+		static string ReadString(PckFile& pck, const char* filename)
+		{
+			auto data = pck.GetSingleFileData(filename);
+			return string(data.begin(), data.end());
+		}
+
+	public:
+		内容去重()
+		{
+			policy.dedup = true;
+			for (int i = 0; i < 20000; ++i)
+			{
+				a.push_back("0123456789abcdef"[i * 7 % 16]);
+				b.push_back("fedcba9876543210"[i * 13 % 16]);
+			}
+		}
+
+		TEST_METHOD(相同内容共享数据)
+		{
+			{
+				auto pck = PckFile::Create("dedup.pck", true);
+				pck->BeginTransaction();
+				pck->AddItem(a.data(), (uint32_t)a.size(), "x/a1.txt");
+				pck->AddItem(a.data(), (uint32_t)a.size(), "x/a2.txt");
+				pck->AddItem(a.data(), (uint32_t)a.size(), "x/a3.txt");
+				pck->AddItem(b.data(), (uint32_t)b.size(), "x/b.txt");
+				pck->CommitTransaction({}, policy);
+				auto report = pck->GetCompressReport();
+				Assert::IsTrue(report.deduped == 2);
+				Assert::IsTrue(pck->GetRedundancySize() == 0);
+			}
+			{
+				auto pck = PckFile::Open("dedup.pck", false);
+				// 删除和更新共享数据的文件，其他共享者的数据不变，也不产生冗余
+				pck->DeleteItem((*pck)["x/a1.txt"]);
+				pck->UpdateItem((*pck)["x/a2.txt"], "short", 5);
+				Assert::IsTrue(pck->GetRedundancySize() == 0);
+				// 与文件包中已有的文件内容相同
+				pck->AddItem(b.data(), (uint32_t)b.size(), "y/b.txt", policy);
+				Assert::IsTrue(pck->GetCompressReport().deduped == 1);
+				// 删除全部共享者后空间可以被复用
+				pck->BeginTransaction();
+				pck->DeleteItem((*pck)["x/b.txt"]);
+				pck->DeleteItem((*pck)["y/b.txt"]);
+				pck->AddItem(a.data(), (uint32_t)a.size(), "y/a.txt");
+				pck->CommitTransaction({}, policy);
+			}
+			auto pck = PckFile::Open("dedup.pck");
+			Assert::IsTrue(pck->GetFileCount() == 3);
+			Assert::IsTrue(ReadString(*pck, "x/a2.txt") == "short");
+			Assert::IsTrue(ReadString(*pck, "x/a3.txt") == a);
+			Assert::IsTrue(ReadString(*pck, "y/a.txt") == a);
+			Assert::IsFalse(pck->FileExists("x/b.txt"));
+		}
+
+		TEST_METHOD(从其他PCK复制文件)
+		{
+			{
+				auto src = PckFile::Create("dedup_src.pck", true);
+				src->BeginTransaction();
+				src->AddItem(a.data(), (uint32_t)a.size(), "a.txt");
+				src->AddItem(b.data(), (uint32_t)b.size(), "b.txt");
+				src->CommitTransaction();
+			}
+			auto src = PckFile::Open("dedup_src.pck");
+			{
+				auto dst = PckFile::Create("dedup_dst.pck", true);
+				dst->BeginTransaction();
+				for (auto& item : *src)
+				{
+					dst->AddItem(item);
+				}
+				dst->AddItem(a.data(), (uint32_t)a.size(), "c.txt");
+				dst->CommitTransaction({}, policy);
+				Assert::IsTrue(dst->GetCompressReport().deduped == 0);
+			}
+			auto dst = PckFile::Open("dedup_dst.pck");
+			Assert::IsTrue(dst->GetFileCount() == 3);
+			Assert::IsTrue(ReadString(*dst, "a.txt") == a);
+			Assert::IsTrue(ReadString(*dst, "b.txt") == b);
+			Assert::IsTrue(ReadString(*dst, "c.txt") == a);
+		}
+	};
+
+	TEST_CLASS(空间回收)
+	{
+		map<string, string> files;
+
+		// 创建一个有空洞的文件包：删除一部分文件，把一部分文件更新为更大的内容
+		void MakeHoles(const char* filename)
+		{
+			PckFile::CompressPolicy policy;
+			policy.dedup = true;
+			files.clear();
+			{
+				auto pck = PckFile::Create(filename, true);
+				pck->BeginTransaction();
+				for (int i = 0; i < 60; ++i)
+				{
+					AddContent(*pck, files, "dir/" + to_string(i) + ".txt", i % 13 + 1, 3000 + i * 97);
+				}
+				// 与已有文件内容相同，共享数据
+				files["dir/same.txt"] = files["dir/1.txt"];
+				pck->AddItem(files["dir/same.txt"].data(), (uint32_t)files["dir/same.txt"].size(), "dir/same.txt");
+				pck->CommitTransaction({}, policy);
+			}
+			auto pck = PckFile::Open(filename, false);
+			pck->BeginTransaction();
+			for (int i = 0; i < 60; i += 3)
+			{
+				auto name = "dir/" + to_string(i) + ".txt";
+				pck->DeleteItem((*pck)[name]);
+				files.erase(name);
+			}
+			for (int i = 1; i < 60; i += 6)
+			{
+				auto name = "dir/" + to_string(i) + ".txt";
+				files[name] = MakeContent(i % 5 + 3, 9000);
+				pck->UpdateItem((*pck)[name], files[name].data(), (uint32_t)files[name].size());
+			}
+			pck->CommitTransaction({}, policy);
+			Assert::IsTrue(pck->GetRedundancySize() > 0);
+		}
+
+	public:
+		TEST_METHOD(复用空闲空间)
+		{
+			MakeHoles("freespace.pck");
+			{
+				auto pck = PckFile::Open("freespace.pck", false);
+				auto size = pck->GetFileSize();
+				auto redundancy = pck->GetRedundancySize();
+				// 新文件都比空洞小，写入空洞中，文件只因索引变大而增长
+				pck->BeginTransaction();
+				for (int i = 0; i < 10; ++i)
+				{
+					auto name = "new/" + to_string(i) + ".txt";
+					files[name] = MakeContent(100 + i, 1500);
+					pck->AddItem(files[name].data(), (uint32_t)files[name].size(), name);
+				}
+				pck->CommitTransaction();
+				uint64_t added = 0;
+				for (int i = 0; i < 10; ++i)
+				{
+					added += (*pck)["new/" + to_string(i) + ".txt"].GetCompressDataSize();
+				}
+				Assert::IsTrue(pck->GetRedundancySize() < redundancy);
+				Assert::IsTrue(pck->GetFileSize() < size + added);
+			}
+			CheckFiles("freespace.pck", files);
+			{
+				// 更新为更小的内容时原地写入，删除后的空洞在重新打开后仍然可以复用
+				auto pck = PckFile::Open("freespace.pck", false);
+				pck->BeginTransaction();
+				files["dir/2.txt"] = MakeContent(200, 500);
+				pck->UpdateItem((*pck)["dir/2.txt"], files["dir/2.txt"].data(), (uint32_t)files["dir/2.txt"].size());
+				pck->DeleteItem((*pck)["new/0.txt"]);
+				files.erase("new/0.txt");
+				pck->CommitTransaction();
+			}
+			{
+				auto pck = PckFile::Open("freespace.pck", false);
+				auto size = pck->GetFileSize();
+				pck->BeginTransaction();
+				files["new/0.txt"] = MakeContent(300, 1000);
+				pck->AddItem(files["new/0.txt"].data(), (uint32_t)files["new/0.txt"].size(), "new/0.txt");
+				pck->CommitTransaction();
+				Assert::IsTrue(pck->GetFileSize() < size + pck->GetSingleFileItem("new/0.txt").GetCompressDataSize());
+			}
+			CheckFiles("freespace.pck", files);
+		}
+
+		TEST_METHOD(原地整理)
+		{
+			MakeHoles("compact.pck");
+			{
+				auto pck = PckFile::Open("compact.pck", false);
+				auto redundancy = pck->GetRedundancySize();
+				// 中途停止只合并空洞，不回收空间，已移动的文件仍然可以读取
+				int n = 0;
+				pck->Compact([&](uint32_t, uint32_t) { return ++n < 10; });
+				Assert::IsTrue(pck->GetRedundancySize() == redundancy);
+			}
+			CheckFiles("compact.pck", files);
+			{
+				auto pck = PckFile::Open("compact.pck", false);
+				auto size = pck->GetFileSize();
+				// 索引中的位置改变后压缩大小会有几个字节的变化，回收的字节数与冗余不完全相等
+				auto reclaimed = pck->Compact();
+				Assert::IsTrue(reclaimed > 0);
+				Assert::IsTrue(pck->GetRedundancySize() == 0);
+				Assert::IsTrue(pck->GetFileSize() == size - reclaimed);
+				// 整理后继续修改
+				pck->BeginTransaction();
+				files["dir/new.txt"] = MakeContent(7, 5000);
+				pck->AddItem(files["dir/new.txt"].data(), (uint32_t)files["dir/new.txt"].size(), "dir/new.txt");
+				pck->CommitTransaction();
+			}
+			CheckFiles("compact.pck", files);
+		}
+	};
+
+	TEST_CLASS(索引)
+	{
+		map<string, string> files;
+
+	public:
+		TEST_METHOD(索引缓存文件)
+		{
+			PckFile::OpenOptions options;
+			options.indexcache = true;
+			files.clear();
+			{
+				auto pck = PckFile::Create("indexcache.pck", true);
+				pck->BeginTransaction();
+				for (int i = 0; i < 50; ++i)
+				{
+					AddContent(*pck, files, "cache/" + to_string(i) + ".txt", i % 11 + 1, 1000 + i * 31);
+				}
+				pck->CommitTransaction();
+			}
+			filesystem::remove("indexcache.pck.idx");
+			// 第一次打开生成缓存，第二次从缓存加载
+			CheckFiles("indexcache.pck", files, options);
+			Assert::IsTrue(filesystem::exists("indexcache.pck.idx"));
+			CheckFiles("indexcache.pck", files, options);
+			{
+				// 不使用缓存修改文件包后，缓存失效，重新打开时重新生成
+				auto pck = PckFile::Open("indexcache.pck", false);
+				pck->BeginTransaction();
+				pck->DeleteItem((*pck)["cache/3.txt"]);
+				files.erase("cache/3.txt");
+				pck->RenameItem((*pck)["cache/4.txt"], "cache/renamed.txt");
+				files["cache/renamed.txt"] = files["cache/4.txt"];
+				files.erase("cache/4.txt");
+				AddContent(*pck, files, "cache/new.txt", 17, 2000);
+				pck->CommitTransaction();
+			}
+			CheckFiles("indexcache.pck", files, options);
+			CheckFiles("indexcache.pck", files, options);
+			{
+				// 使用缓存打开后修改
+				options.readonly = false;
+				auto pck = PckFile::Open("indexcache.pck", options);
+				options.readonly = true;
+				pck->BeginTransaction();
+				files["cache/5.txt"] = MakeContent(23, (int)files["cache/5.txt"].size());
+				pck->UpdateItem((*pck)["cache/5.txt"], files["cache/5.txt"].data(), (uint32_t)files["cache/5.txt"].size());
+				AddContent(*pck, files, "cache/new2.txt", 19, 3000);
+				pck->CommitTransaction();
+			}
+			CheckFiles("indexcache.pck", files, options);
+			CheckFiles("indexcache.pck", files);
+		}
+
+		TEST_METHOD(多次提交后重新打开)
+		{
+			PckFile::OpenOptions lazy;
+			lazy.lazyindex = true;
+			files.clear();
+			auto pck = PckFile::Create("indexwrite.pck", true);
+			pck->BeginTransaction();
+			for (int i = 0; i < 50; ++i)
+			{
+				AddContent(*pck, files, "index/" + to_string(i) + ".txt", i % 7 + 1, 500 + i * 13);
+			}
+			pck->CommitTransaction();
+			CheckFiles("indexwrite.pck", files);
+
+			// 每次提交只重写从第一条改变的记录开始的索引，改名使记录长度改变，之后的记录都要移动
+			pck->BeginTransaction();
+			pck->RenameItem((*pck)["index/20.txt"], "index/a/much/longer/name/for/20.txt");
+			files["index/a/much/longer/name/for/20.txt"] = files["index/20.txt"];
+			files.erase("index/20.txt");
+			pck->CommitTransaction();
+			CheckFiles("indexwrite.pck", files);
+
+			// 删除前面的记录，更新和添加文件
+			pck->BeginTransaction();
+			pck->DeleteItem((*pck)["index/1.txt"]);
+			files.erase("index/1.txt");
+			files["index/30.txt"] = MakeContent(3, 5000);
+			pck->UpdateItem((*pck)["index/30.txt"], files["index/30.txt"].data(), (uint32_t)files["index/30.txt"].size());
+			AddContent(*pck, files, "index/new.txt", 9, 800);
+			pck->CommitTransaction();
+			CheckFiles("indexwrite.pck", files);
+			CheckFiles("indexwrite.pck", files, lazy);
+
+			// 只改变最后一条记录
+			pck->BeginTransaction();
+			pck->RenameItem((*pck)["index/new.txt"], "index/n.txt");
+			files["index/n.txt"] = files["index/new.txt"];
+			files.erase("index/new.txt");
+			pck->CommitTransaction();
+			pck.reset();
+			CheckFiles("indexwrite.pck", files);
+			CheckFiles("indexwrite.pck", files, lazy);
+		}
+
+		TEST_METHOD(删除文件后文件对象失效)
+		{
+			files.clear();
+			auto pck = PckFile::Create("itemvalid.pck", true);
+			pck->BeginTransaction();
+			for (int i = 0; i < 5; ++i)
+			{
+				AddContent(*pck, files, "valid/" + to_string(i) + ".txt", i + 1, 100);
+			}
+			pck->CommitTransaction();
+			PckItem item = (*pck)["valid/3.txt"];
+			// 不删除文件的提交不改变序号，文件对象仍然有效
+			pck->BeginTransaction();
+			pck->RenameItem((*pck)["valid/4.txt"], "valid/5.txt");
+			pck->CommitTransaction();
+			Assert::AreEqual("valid\\3.txt", item.GetFileName());
+			pck->BeginTransaction();
+			pck->DeleteItem((*pck)["valid/1.txt"]);
+			pck->CommitTransaction();
+#ifndef NDEBUG
+			Assert::ExpectException<std::logic_error>([&]() { item.GetFileName(); });
+#endif
+			// 重新获取的文件对象有效
+			Assert::AreEqual("valid\\3.txt", (*pck)["valid/3.txt"].GetFileName());
+		}
 	};
 
 	/*
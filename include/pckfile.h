@@ -5,6 +5,11 @@
 #include <tuple>
 #include <vector>
 #include <functional>
+#include <span>
+#include <future>
+#include <exception>
+#include <string>
+#include <utility>
 #include "pckdef.h"
 
 class PckItem;
@@ -20,6 +25,80 @@ public:
 	typedef std::vector<PckItem>::const_iterator PckItemIterator;
 	typedef std::function<bool(uint32_t index, uint32_t total)> ProcessCallback;
 
+	// 打开选项
+	struct OpenOptions
+	{
+		// 只读模式
+		bool readonly = true;
+		// 使用索引缓存文件（xxx.pck.idx），pck文件未修改时直接从缓存加载索引，否则在打开后重新生成缓存
+		bool indexcache = false;
+		// 延迟解压索引，打开时只扫描索引的位置，在第一次访问时才解压对应的索引
+		// 按文件名查找会按顺序解压直到找到目标文件，遍历和统计信息会解压全部索引
+		bool lazyindex = false;
+		// 使用内存映射读取文件数据，读取时不加锁、不复制，只在只读模式下有效
+		bool mmap = false;
+		// 解压数据缓存的容量（字节），0表示不使用缓存，参考SetDataCacheCapacity
+		size_t datacache = 0;
+	};
+
+	// 批量读取的选项
+	struct BatchOptions
+	{
+		// 两段数据之间的间隔不超过这个大小时合并为一次读取
+		uint32_t maxgap = 64 * 1024;
+		// 合并后单次读取的最大大小
+		uint32_t maxread = 8 * 1024 * 1024;
+	};
+	// 批量读取的回调，index为文件在请求列表中的序号，data可以被移走
+	typedef std::function<void(size_t index, const PckItem& item, std::vector<uint8_t>& data)> BatchSink;
+
+	// 异步读取的回调，成功时error为空，data可以被移走，失败时error保存异常
+	typedef std::function<void(const PckItem& item, std::vector<uint8_t>& data, std::exception_ptr error)> AsyncCallback;
+
+	// 解压数据缓存的统计信息
+	struct DataCacheStats
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		// 当前缓存的数据量和文件数
+		size_t bytes = 0;
+		size_t count = 0;
+		size_t capacity = 0;
+	};
+
+	// 压缩策略，决定每个文件的压缩等级，以及压缩效果太差时是否直接保存原始数据
+	struct CompressPolicy
+	{
+		// 默认压缩等级，-1为zlib的默认等级，0为不压缩
+		int level = -1;
+		// 按扩展名指定压缩等级，扩展名不含点、不区分大小写，如 {"ogg", 0}，优先于默认等级
+		std::vector<std::pair<std::string, int>> extlevels;
+		// 压缩后大小与原始大小之比超过这个值时保存原始数据，1.0表示只在压缩后反而更大时才保存原始数据
+		double threshold = 0.95;
+		// 大于两倍probesize的文件先试压缩开头的probesize字节，比例超过threshold时不再压缩整个文件，0表示不试压缩
+		uint32_t probesize = 64 * 1024;
+		// 按内容去重，与文件包中已有的或同一次提交中的文件内容完全相同时，新文件直接使用已有的数据，不再压缩和写入
+		bool dedup = false;
+	};
+
+	// 一次提交的压缩统计
+	struct CompressReport
+	{
+		// 压缩保存和保存原始数据的文件数，太小的文件、压缩等级为0和压缩效果太差的文件保存原始数据
+		uint32_t compressed = 0;
+		uint32_t stored = 0;
+		// 其中因试压缩效果太差而没有压缩整个文件的文件数
+		uint32_t probed = 0;
+		// 原始数据和实际写入的数据总大小，两者之差为节省的字节数
+		uint64_t databytes = 0;
+		uint64_t writtenbytes = 0;
+		// 因内容相同而共享已有数据的文件数和这些文件的原始数据大小，不计入以上各项
+		uint32_t deduped = 0;
+		uint64_t dedupbytes = 0;
+		// 压缩花费的时间（秒），多线程压缩时为各线程的时间之和
+		double seconds = 0;
+	};
+
 	virtual ~PckFile();
 
 	//******************************
@@ -27,6 +106,7 @@ public:
 	//******************************
 	// 打开现有文件，返回shared_ptr，失败抛出异常
 	static std::shared_ptr<PckFile> Open(const std::string& filename, bool readonly = true);
+	static std::shared_ptr<PckFile> Open(const std::string& filename, const OpenOptions& options);
 	// 创建一个空白的对象，返回shared_ptr
 	static std::shared_ptr<PckFile> Create(const std::string& filename, bool overwrite = false);
 
@@ -44,15 +124,56 @@ public:
 	std::vector<uint8_t> GetSingleFileData(const std::string& filename);
 	std::vector<uint8_t> GetSingleFileData(const PckItem& item);
 	std::vector<uint8_t> GetSingleFileCompressData(const PckItem& item);
+	// 解压到调用者提供的缓冲区，缓冲区大小不能小于GetDataSize()，返回实际数据大小，失败抛出异常
+	// 压缩数据使用每个线程独立的可重复使用的缓冲区，调用过程中没有内存分配
+	uint32_t GetSingleFileData(const PckItem& item, std::span<uint8_t> buf);
+	// 解压到可重复使用的vector中，只在容量不足时才重新分配内存
+	void GetSingleFileData(const PckItem& item, std::vector<uint8_t>& buf);
+	// 读取压缩数据到调用者提供的缓冲区，缓冲区大小不能小于GetCompressDataSize()，返回实际数据大小
+	uint32_t GetSingleFileCompressData(const PckItem& item, std::span<uint8_t> buf);
+	// 从压缩数据的pos处开始读取，最多读满缓冲区，返回实际读取的大小，用于流式读取
+	uint32_t GetSingleFileCompressData(const PckItem& item, uint32_t pos, std::span<uint8_t> buf);
+	// 获取文件压缩数据的只读视图，不复制数据，只能在使用内存映射打开时调用，失败抛出异常
+	// 视图在PckFile对象存在期间一直有效
+	std::span<const uint8_t> GetSingleFileCompressView(const PckItem& item);
+	// 获取共享的文件数据，启用数据缓存时，重复读取同一文件只需要查找缓存，失败抛出异常
+	std::shared_ptr<const std::vector<uint8_t>> GetSingleFileDataShared(const PckItem& item);
+	// 批量读取文件数据，按数据在文件中的位置排序，把相邻或间隔很小的数据合并为一次顺序读取，再多线程解压
+	// 按items中的顺序在调用线程中依次调用sink，失败抛出异常
+	void ReadBatch(const std::vector<const PckItem*>& items, BatchSink sink);
+	void ReadBatch(const std::vector<const PckItem*>& items, BatchSink sink, const BatchOptions& options);
+	// 同上，按items中的顺序返回所有文件的数据
+	std::vector<std::vector<uint8_t>> ReadBatch(const std::vector<const PckItem*>& items);
+	std::vector<std::vector<uint8_t>> ReadBatch(const std::vector<const PckItem*>& items, const BatchOptions& options);
 
 	//文件是否存在
 	bool FileExists(const std::string& filename) const noexcept;
 
 
+	//******************************
+	// 异步读取
+	//******************************
+	// 异步读取文件数据，在Linux中优先使用io_uring提交读取，不可用时在线程池中使用pread，解压在另一个线程池中进行
+	// 回调在内部线程中调用，读取期间不能修改文件包，PckFile对象析构时会等待所有未完成的读取
+	void ReadAsync(const PckItem& item, AsyncCallback callback);
+	std::future<std::vector<uint8_t>> ReadAsync(const PckItem& item);
+
+	//******************************
+	// 数据缓存
+	//******************************
+	// 设置解压数据缓存的容量（字节），0表示禁用缓存，同时会清空已缓存的数据
+	// 启用后，读取文件数据时优先从缓存中获取，提交事务时自动移除被修改和删除的文件
+	void SetDataCacheCapacity(size_t capacity);
+	DataCacheStats GetDataCacheStats() const;
+	// 预先读取指定目录下的文件到缓存中，直到缓存容量用完，目录为空时读取所有文件
+	// 返回读取的文件数，失败抛出异常
+	uint32_t WarmDataCache(const std::string& dirname);
+
 	//******************************
 	// 遍历
 	//******************************
-	PckItemIterator begin() const noexcept;
+	// 延迟解压索引时，begin()会解压全部索引，失败抛出异常
+	PckItemIterator begin() const;
 	PckItemIterator end() const noexcept;
 	size_t size() const noexcept;
 	const PckItem& operator[](size_t index) const;
@@ -64,6 +185,9 @@ public:
 	void AddItem(const void* buf, uint32_t len, const std::string& filename);
 	void AddItem(const PckItem& item);
 	void AddItem(const std::string& diskfilename, const std::string& pckfilename);
+	// 使用指定的压缩策略添加文件，同名文件已存在时用这个策略更新，优先于提交事务时指定的策略
+	void AddItem(const void* buf, uint32_t len, const std::string& filename, const CompressPolicy& policy);
+	void AddItem(const std::string& diskfilename, const std::string& pckfilename, const CompressPolicy& policy);
 	void DeleteItem(const PckItem& item);
 	void RenameItem(const PckItem& item, const std::string& newname);
 	void UpdateItem(const PckItem& item, const void* buf, uint32_t len);
@@ -71,6 +195,9 @@ public:
 
 	// 删除目录，返回目录下的文件数，返回值不代表实际删除结果
 	int DeleteDirectory(const std::string& dirname);
+	// 重命名（移动）目录，目录下所有文件的路径前缀替换为newname，返回目录下的文件数
+	// 新文件名与目录外的文件冲突时抛出异常，不做任何修改
+	int RenameDirectory(const std::string& dirname, const std::string& newname);
 
 	//******************************
 	// 解压
@@ -86,9 +213,10 @@ public:
 	// 统计信息
 	//******************************
 	uint64_t GetFileSize() const noexcept;
-	uint64_t GetTotalDataSize() const noexcept;
-	uint64_t GetTotalCompressDataSize() const noexcept;
-	uint64_t GetRedundancySize() const noexcept;
+	// 延迟解压索引时，以下三项统计信息会解压全部索引，失败抛出异常
+	uint64_t GetTotalDataSize() const;
+	uint64_t GetTotalCompressDataSize() const;
+	uint64_t GetRedundancySize() const;
 	uint64_t GetIndexTableSize() const noexcept;
 
 	//******************************
@@ -100,14 +228,44 @@ public:
 	void CancelTransaction() noexcept;
 	// 提交事务，实际写入文件，失败抛出异常
 	void CommitTransaction(ProcessCallback callback = {});
+	// 使用压缩策略提交事务，添加文件时没有指定策略的文件都使用这个策略
+	// 不指定策略时使用zlib的默认等级，并总是保存压缩后的数据
+	void CommitTransaction(ProcessCallback callback, const CompressPolicy& policy);
+	// 最近一次提交事务的压缩统计
+	CompressReport GetCompressReport() const noexcept;
+
+	//******************************
+	// 整理
+	//******************************
+	// 原地整理数据区，把文件数据按位置顺序依次前移填满空洞，之后截断文件，返回回收的字节数
+	// 每移动一段数据前调用callback，返回false时停止并写入索引，再次调用时从剩余的空洞继续
+	// 覆盖仍被磁盘索引引用的区域前、以及每移动64MB数据后都会先把索引写到原数据区末尾之后并切换文件头，
+	// 中途被终止时已移动的文件都可以通过上一次写入的索引读取；只有正在移动的一段数据与自身原位置重叠时，断电才可能损坏这一段
+	// 中断或被callback停止时只合并空洞，文件不会变小（返回值接近0，GetRedundancySize不变），完整运行一次后才截断回收空间
+	// 不能在事务中调用
+	uint64_t Compact(ProcessCallback callback = {});
+
+	//******************************
+	// 访问记录
+	//******************************
+	// 开始记录文件的读取顺序，每个文件只记录第一次读取，之前的记录被清除
+	void StartAccessTrace();
+	// 停止记录，已记录的内容保留
+	void StopAccessTrace() noexcept;
+	// 把记录保存到文件，供ReBuildWithTrace使用
+	void SaveAccessTrace(const std::string& filename) const;
 
 	//******************************
 	// 压缩（静态）
 	//******************************
 	// 从指定目录创建pck文件，参数3指定是否使用参数2的目录名作为根目录名
 	static void CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname = true, bool overwrite = false, ProcessCallback callback = {});
+	// 同上，使用指定的压缩策略，返回压缩统计
+	static CompressReport CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname, bool overwrite, ProcessCallback callback, const CompressPolicy& policy);
 	// 重建文件包，在冗余数据量过大时使用
 	static void ReBuild(const std::string& filename, const std::string& newname, bool overwrite = false, ProcessCallback callback = {});
+	// 按访问记录的顺序重建文件包，使启动时的读取尽可能连续，记录中没有的文件按目录分组排在后面
+	static void ReBuildWithTrace(const std::string& filename, const std::string& newname, const std::string& tracefile, bool overwrite = false, ProcessCallback callback = {});
 
 private:
 	class PckFileImpl;
@@ -45,6 +45,7 @@ bool STDCALL Pck_RenameItem(PckFile_c pck, PckItem_c item, const char* newname);
 bool STDCALL Pck_UpdateItem_buf(PckFile_c pck, PckItem_c item, const void* buf, uint32_t len);
 bool STDCALL Pck_UpdateItem_file(PckFile_c pck, PckItem_c item, const char* diskfilename);
 bool STDCALL Pck_DeleteDirectory(PckFile_c pck, const char* dirname);
+bool STDCALL Pck_RenameDirectory(PckFile_c pck, const char* dirname, const char* newname);
 
 bool STDCALL Pck_Extract(PckFile_c pck, const char* dir, ProcessCallback_c callback = NULL);
 bool STDCALL Pck_Extract_if(PckFile_c pck, const char* dir, bool(STDCALL *fn)(PckItem_c), ProcessCallback_c callback = NULL);
@@ -58,6 +59,7 @@ uint64_t STDCALL Pck_GetIndexTableSize(PckFile_c pck);
 bool STDCALL Pck_BeginTransaction(PckFile_c pck);
 bool STDCALL Pck_CancelTransaction(PckFile_c pck);
 bool STDCALL Pck_CommitTransaction(PckFile_c pck, ProcessCallback_c callback = NULL);
+bool STDCALL Pck_Compact(PckFile_c pck, ProcessCallback_c callback = NULL);
 
 bool STDCALL Pck_CreateFromDirectory(const char* filename, const char* dir, bool usedirname = true, bool overwrite = false, ProcessCallback_c callback = NULL);
 bool STDCALL Pck_ReBuild(const char* filename, const char* newname, bool overwrite = false, ProcessCallback_c callback = NULL);
@@ -3,14 +3,25 @@
 #include <cstdint>
 #include <memory>
 #include <vector>
+#include <span>
 
 #include "pckdef.h"
 
 class PckFile;
-
+class PckIndexTable;
+
+// 文件对象，只是指向PckFile内部索引表中某一项的轻量句柄，按序号引用，不持有PckFile对象
+// 失效规则：
+// 1. 所属的PckFile对象释放后，文件对象不能再使用，此时无法检测，使用会访问已释放的内存
+// 2. 提交删除了文件的事务（包括DeleteItem、DeleteDirectory、更新时移除同名文件）之后，序号整体前移，
+//    之前获取的文件对象（包括复制的对象和迭代器）会指向其他文件，需要重新获取；调试版本中使用已失效的对象会抛出异常
+// 3. 文件对象可以传给其他PckFile对象的AddItem，待提交的操作会持有源PckFile对象直到提交结束
 class PckItem
 {
 	friend class PckFile;
+	friend class PckPendingItem_AddPckItem;
+	friend class PckPendingItem_Rename;
+	friend class PckPendingItem_Update;
 
 public:
 	PckItem() = default;
@@ -22,12 +33,22 @@ public:
 	// 以下两个方法不推荐使用，效率略低，尽可能使用PckFile类中的方法
 	std::vector<uint8_t> GetCompressData() const;
 	std::vector<uint8_t> GetData() const;
+	// 解压到调用者提供的缓冲区，参考PckFile::GetSingleFileData
+	uint32_t GetData(std::span<uint8_t> buf) const;
+	void GetData(std::vector<uint8_t>& buf) const;
 	bool operator==(const PckItem& item) const
 	{
 		return &item == this;
 	}
 
 private:
-	_PckItemIndex m_index {};
-	std::weak_ptr<PckFile> m_pck;  // 使用弱引用指向父PckFile对象，避免循环引用
+	PckItem(const PckIndexTable* table, uint32_t index, uint32_t generation) : m_table(table), m_index(index), m_generation(generation) {}
+
+	// 调试版本中检查文件对象是否已因删除文件而失效，失效时抛出异常
+	void CheckValid() const;
+
+	const PckIndexTable* m_table = nullptr;
+	uint32_t m_index = 0;
+	// 创建时索引表的Generation()，不论是否调试版本都保存，保证对象布局一致
+	uint32_t m_generation = 0;
 };
\ No newline at end of file
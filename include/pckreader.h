@@ -0,0 +1,62 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <istream>
+#include <streambuf>
+#include <vector>
+
+class PckFile;
+class PckItem;
+
+// 流式读取文件数据，每次只读取和解压一小块压缩数据，内存占用与文件大小无关
+// 读取期间所属的PckFile对象必须一直存在，且不能修改
+class PckItemReader
+{
+public:
+	// buffersize为每次从文件中读取的压缩数据大小
+	PckItemReader(PckFile& pck, const PckItem& item, uint32_t buffersize = 256 * 1024);
+	~PckItemReader();
+
+	// 读取最多n字节解压后的数据，返回实际读取的字节数，返回0表示已经读完，失败抛出异常
+	size_t Read(void* buf, size_t n);
+	// 解压后的数据大小
+	uint64_t Size() const noexcept;
+	// 已经读取的数据大小
+	uint64_t Tell() const noexcept;
+	bool Eof() const noexcept;
+
+private:
+	PckItemReader(const PckItemReader&) = delete;
+	void operator=(const PckItemReader&) = delete;
+
+	class Impl;
+	std::unique_ptr<Impl> pImpl;
+};
+
+// 基于PckItemReader的streambuf，只支持顺序读取
+class PckItemStreamBuf : public std::streambuf
+{
+public:
+	PckItemStreamBuf(PckFile& pck, const PckItem& item, uint32_t buffersize = 64 * 1024);
+
+protected:
+	virtual int_type underflow() override;
+
+private:
+	PckItemReader m_reader;
+	std::vector<char> m_buf;
+};
+
+// 以std::istream的方式读取文件数据，解压失败时设置badbit
+class PckItemIStream : public std::istream
+{
+public:
+	PckItemIStream(PckFile& pck, const PckItem& item) : std::istream(nullptr), m_buf(pck, item)
+	{
+		rdbuf(&m_buf);
+	}
+
+private:
+	PckItemStreamBuf m_buf;
+};
@@ -21,6 +21,7 @@ bool ListAll(const char* pckname);
 bool ListTree(const char* pckname);
 bool AddFile(const char* pckname, const char* diskfilename, const char* pckfilename);
 bool DeleteFile(const char* pckname, const char* pckfilename);
+bool RenameDir(const char* pckname, const char* dirname, const char* newname);
 bool ReBuild(const char* pckname, const char* outname);
 
 #define HELPSTR "{0} 2018.08.03\n" \
@@ -52,6 +53,9 @@ bool ReBuild(const char* pckname, const char* outname);
 "{0} -d input.pck pckfilename\n" \
 "如果以“\\”结尾，则为目录，否则为文件。\n" \
 "\n" \
+"重命名（移动）目录：\n" \
+"{0} -m input.pck dirname newdirname\n" \
+"\n" \
 "重建：\n" \
 "{0} -r input.pck output.pck\n" \
 "\n" \
@@ -139,6 +143,17 @@ int main(int argc, char* argv[])
 			fprintf(stderr, "错误：无效参数\n");
 		}
 	}
+	else if (strcmp("-m", argv[1]) == 0)
+	{
+		if (argc == 5)
+		{
+			ret = RenameDir(argv[2], argv[3], argv[4]);
+		}
+		else
+		{
+			fprintf(stderr, "错误：无效参数\n");
+		}
+	}
 	else if (strcmp("-r", argv[1]) == 0)
 	{
 		if (argc == 4)
@@ -435,6 +450,23 @@ bool DeleteFile(const char* pckname, const char* pckfilename)
 	return ret;
 }
 
+bool RenameDir(const char* pckname, const char* dirname, const char* newname)
+{
+	bool ret = false;
+	try
+	{
+		auto pck = PckFile::Open(pckname, false);
+		auto n = pck->RenameDirectory(dirname, newname);
+		printf("已移动 %d 个文件\n", n);
+		ret = true;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "操作失败：%s\n", e.what());
+	}
+	return ret;
+}
+
 bool ReBuild(const char* pckname, const char* outname)
 {
 	bool ret = false;
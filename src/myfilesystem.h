@@ -10,7 +10,12 @@ namespace filesystem = std::filesystem;
 #endif
 
 #include <cstdio>
+#include <cstdint>
 #if defined(_WINDOWS) || defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
 #include <io.h>
 #define ftruncate	_chsize_s
 #define fileno		_fileno
@@ -19,9 +24,96 @@ namespace filesystem = std::filesystem;
 #else
 #define _FILE_OFFSET_BITS 64
 #include <unistd.h>
+#include <cerrno>
 // TODO: 测试Linux中64位文件偏移的兼容性
 #endif
 
+// 从文件的指定位置读取数据，不使用FILE的缓冲区和读写指针，可以多线程同时调用
+// 返回实际读取的字节数，读到文件末尾时小于len
+inline size_t MyPRead(FILE* f, void* buf, size_t len, uint64_t pos)
+{
+	size_t total = 0;
+#if defined(_WINDOWS) || defined(_WIN32)
+	// 同步句柄上的ReadFile会移动系统的文件指针，所以不能与同一文件上的写入同时进行，
+	// FILE在每次Seek时都会重新定位，之后的读写不受影响
+	auto h = (HANDLE)_get_osfhandle(_fileno(f));
+	while (total < len)
+	{
+		OVERLAPPED ov = {};
+		ov.Offset = (DWORD)(pos + total);
+		ov.OffsetHigh = (DWORD)((pos + total) >> 32);
+		DWORD nread = 0;
+		auto n = (DWORD)((len - total) > 0x40000000 ? 0x40000000 : (len - total));
+		if (!ReadFile(h, (char*)buf + total, n, &nread, &ov) || nread == 0)
+			break;
+		total += nread;
+	}
+#else
+	while (total < len)
+	{
+		auto n = pread(fileno(f), (char*)buf + total, len - total, pos + total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += n;
+	}
+#endif
+	return total;
+}
+
+// 向文件的指定位置写入数据，不使用FILE的缓冲区和读写指针，可以多线程同时写入不同的位置
+// 返回实际写入的字节数，出错时小于len
+inline size_t MyPWrite(FILE* f, const void* buf, size_t len, uint64_t pos)
+{
+	size_t total = 0;
+#if defined(_WINDOWS) || defined(_WIN32)
+	auto h = (HANDLE)_get_osfhandle(_fileno(f));
+	while (total < len)
+	{
+		OVERLAPPED ov = {};
+		ov.Offset = (DWORD)(pos + total);
+		ov.OffsetHigh = (DWORD)((pos + total) >> 32);
+		DWORD nwrite = 0;
+		auto n = (DWORD)((len - total) > 0x40000000 ? 0x40000000 : (len - total));
+		if (!WriteFile(h, (const char*)buf + total, n, &nwrite, &ov) || nwrite == 0)
+			break;
+		total += nwrite;
+	}
+#else
+	while (total < len)
+	{
+		auto n = pwrite(fileno(f), (const char*)buf + total, len - total, pos + total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += n;
+	}
+#endif
+	return total;
+}
+
+// 在两个文件之间直接复制数据，由内核完成，不经过用户态缓冲区，可以多线程同时调用
+// 返回实际复制的字节数，不支持时（例如跨文件系统或非Linux系统）返回0，调用者需要自己复制剩余的部分
+inline size_t MyCopyFileRange(FILE* in, uint64_t inpos, FILE* out, uint64_t outpos, size_t len)
+{
+	size_t total = 0;
+#if defined(__linux__)
+	while (total < len)
+	{
+		off64_t off1 = inpos + total, off2 = outpos + total;
+		auto n = copy_file_range(fileno(in), &off1, fileno(out), &off2, len - total, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		total += n;
+	}
+#endif
+	return total;
+}
+
 inline uint64_t MyGetFileSize(const char* filename)
 {
 	uint64_t ret = 0;
@@ -0,0 +1,182 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <zlib.h>
+
+// 访问记录文件的格式
+// 文件头之后依次为每个文件名的记录：uint16_t 与上一个文件名相同的前缀长度、uint16_t 剩余部分的长度、剩余部分
+// 文件名按第一次读取的顺序排列，相邻的文件通常在同一个目录下，前缀压缩后文件很小
+
+#define PCK_TRACE_MAGIC			0x43525450	// "PTRC"
+#define PCK_TRACE_VERSION		1
+
+#pragma pack(1)
+struct PckTraceHead
+{
+	uint32_t dwMagic;
+	uint32_t dwVersion;
+	uint32_t dwCount;
+	uint32_t dwDataSize;
+	uint32_t dwCrc32;		// 文件头之后所有数据的crc32
+};
+#pragma pack()
+
+// 记录文件的读取顺序，每个文件只记录第一次读取，可以多线程同时调用
+class PckAccessTrace
+{
+public:
+	bool IsActive() const noexcept
+	{
+		return m_active.load(std::memory_order_relaxed);
+	}
+
+	// 开始记录，之前的记录被清除
+	void Start()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_seen.clear();
+		m_names.clear();
+		m_active = true;
+	}
+
+	void Stop() noexcept
+	{
+		m_active = false;
+	}
+
+	void Record(std::string_view name)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_active)
+		{
+			return;
+		}
+		// 先用string_view查找，重复读取时不构造string
+		if (m_seen.find(name) != m_seen.end())
+		{
+			return;
+		}
+		// unordered_set的元素地址不会改变
+		m_names.push_back(&*m_seen.emplace(name).first);
+	}
+
+	void Save(const std::string& filename) const
+	{
+		std::vector<uint8_t> data;
+		uint32_t count;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			count = (uint32_t)m_names.size();
+			std::string_view prev;
+			for (auto p : m_names)
+			{
+				std::string_view name = *p;
+				uint16_t prefix = 0;
+				while (prefix < prev.size() && prefix < name.size() && prev[prefix] == name[prefix])
+					++prefix;
+				uint16_t len = (uint16_t)(name.size() - prefix);
+				data.insert(data.end(), (const uint8_t*)&prefix, (const uint8_t*)&prefix + 2);
+				data.insert(data.end(), (const uint8_t*)&len, (const uint8_t*)&len + 2);
+				data.insert(data.end(), name.begin() + prefix, name.end());
+				prev = name;
+			}
+		}
+		PckTraceHead head {};
+		head.dwMagic = PCK_TRACE_MAGIC;
+		head.dwVersion = PCK_TRACE_VERSION;
+		head.dwCount = count;
+		head.dwDataSize = (uint32_t)data.size();
+		head.dwCrc32 = crc32(0, data.data(), data.size());
+
+		auto f = fopen(filename.c_str(), "wb");
+		if (!f)
+		{
+			throw std::runtime_error("创建文件失败");
+		}
+		bool ok = fwrite(&head, sizeof(head), 1, f) == 1
+			&& (data.empty() || fwrite(data.data(), data.size(), 1, f) == 1);
+		ok = fclose(f) == 0 && ok;
+		if (!ok)
+		{
+			throw std::runtime_error("写入文件失败");
+		}
+	}
+
+	// 读取记录文件，返回按读取顺序排列的文件名
+	static std::vector<std::string> Load(const std::string& filename)
+	{
+		auto f = fopen(filename.c_str(), "rb");
+		if (!f)
+		{
+			throw std::runtime_error("打开文件失败");
+		}
+		PckTraceHead head {};
+		std::vector<uint8_t> data;
+		bool ok = fread(&head, sizeof(head), 1, f) == 1
+			&& head.dwMagic == PCK_TRACE_MAGIC && head.dwVersion == PCK_TRACE_VERSION;
+		if (ok)
+		{
+			data.resize(head.dwDataSize);
+			ok = data.empty() || fread(data.data(), data.size(), 1, f) == 1;
+		}
+		fclose(f);
+		if (!ok || crc32(0, data.data(), data.size()) != head.dwCrc32)
+		{
+			throw std::runtime_error("访问记录文件格式错误");
+		}
+
+		std::vector<std::string> names;
+		names.reserve(std::min<size_t>(head.dwCount, data.size() / 4));
+		size_t pos = 0;
+		for (uint32_t i = 0; i < head.dwCount; ++i)
+		{
+			uint16_t prefix, len;
+			if (data.size() - pos < 4)
+			{
+				throw std::runtime_error("访问记录文件格式错误");
+			}
+			memcpy(&prefix, data.data() + pos, 2);
+			memcpy(&len, data.data() + pos + 2, 2);
+			pos += 4;
+			if (data.size() - pos < len || (i == 0 ? 0 : names.back().size()) < prefix)
+			{
+				throw std::runtime_error("访问记录文件格式错误");
+			}
+			std::string name;
+			name.reserve(prefix + len);
+			if (prefix)
+				name.assign(names.back(), 0, prefix);
+			name.append((const char*)data.data() + pos, len);
+			pos += len;
+			names.push_back(std::move(name));
+		}
+		return names;
+	}
+
+private:
+	// 透明的哈希函数，可以直接用string_view查找
+	struct NameHash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view s) const noexcept
+		{
+			return std::hash<std::string_view>()(s);
+		}
+	};
+
+	std::atomic<bool> m_active { false };
+	mutable std::mutex m_mutex;
+	std::unordered_set<std::string, NameHash, std::equal_to<>> m_seen;
+	std::vector<const std::string*> m_names;
+};
@@ -0,0 +1,349 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include "myfilesystem.h"
+#include "pckthreadpool.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define PCK_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+// 异步读取文件，在Linux中优先使用io_uring，不可用时在线程池中使用pread
+// 完成回调在内部线程中调用，回调中不能再提交新的读取，应该尽快返回
+// 析构时会等待所有未完成的读取
+class PckAsyncIO
+{
+public:
+	// 完成回调，error为0表示成功，否则为错误码
+	typedef std::function<void(int error)> Completion;
+
+	// nthread为不能使用io_uring时的线程数，0表示使用CPU线程数
+	explicit PckAsyncIO(size_t nthread = 0)
+	{
+#ifdef PCK_HAVE_IO_URING
+		if (_uringinit(256))
+		{
+			return;
+		}
+#endif
+		m_pool = std::make_unique<PckThreadPool>(nthread);
+	}
+
+	~PckAsyncIO()
+	{
+#ifdef PCK_HAVE_IO_URING
+		if (m_ringfd >= 0)
+		{
+			_uringclose();
+		}
+#endif
+		m_pool.reset();
+	}
+
+	bool UsingUring() const noexcept
+	{
+		return !m_pool;
+	}
+
+	// 异步读取文件中[pos, pos + len)的数据，buf必须在完成前一直有效，数据不足时失败
+	void Read(FILE* f, uint64_t pos, void* buf, uint32_t len, Completion callback)
+	{
+		if (m_pool)
+		{
+			m_pool->Post([=] {
+				callback(MyPRead(f, buf, len, pos) == len ? 0 : EIO);
+			});
+			return;
+		}
+#ifdef PCK_HAVE_IO_URING
+		auto req = new Request { f, (char*)buf, len, pos, std::move(callback) };
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this] { return m_broken || m_inflight < m_sqentries; });
+		++m_inflight;
+		if (m_broken)
+		{
+			_uringfallback(req);
+			return;
+		}
+		m_pending.insert(req);
+		if (_uringsubmit(req) != 0)
+		{
+			m_pending.erase(req);
+			_uringfallback(req);
+		}
+#endif
+	}
+
+private:
+	PckAsyncIO(const PckAsyncIO&) = delete;
+	void operator=(const PckAsyncIO&) = delete;
+
+	std::unique_ptr<PckThreadPool> m_pool;
+
+#ifdef PCK_HAVE_IO_URING
+	struct Request
+	{
+		FILE* file;
+		char* buf;
+		uint32_t len;
+		uint64_t pos;
+		Completion callback;
+		iovec iov {};
+	};
+
+	static int _enter(int fd, unsigned tosubmit, unsigned mincomplete, unsigned flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, NULL, 0);
+	}
+
+	bool _uringinit(unsigned entries)
+	{
+		io_uring_params params {};
+		m_ringfd = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (m_ringfd < 0)
+		{
+			return false;
+		}
+		m_sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		m_cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		m_sqessize = params.sq_entries * sizeof(io_uring_sqe);
+		bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single)
+		{
+			m_sqringsize = m_cqringsize = std::max(m_sqringsize, m_cqringsize);
+		}
+		m_sqring = mmap(NULL, m_sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+		m_cqring = single ? m_sqring : mmap(NULL, m_cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING);
+		m_sqes = (io_uring_sqe*)mmap(NULL, m_sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+		if (m_sqring == MAP_FAILED || m_cqring == MAP_FAILED || m_sqes == MAP_FAILED)
+		{
+			_uringunmap();
+			close(m_ringfd);
+			m_ringfd = -1;
+			return false;
+		}
+		auto sq = (char*)m_sqring;
+		auto cq = (char*)m_cqring;
+		m_sqhead = (unsigned*)(sq + params.sq_off.head);
+		m_sqtail = (unsigned*)(sq + params.sq_off.tail);
+		m_sqmask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		m_sqarray = (unsigned*)(sq + params.sq_off.array);
+		m_sqentries = params.sq_entries;
+		m_cqhead = (unsigned*)(cq + params.cq_off.head);
+		m_cqtail = (unsigned*)(cq + params.cq_off.tail);
+		m_cqmask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+		m_reaper = std::thread([this] { _uringreap(); });
+		return true;
+	}
+
+	void _uringunmap()
+	{
+		if (m_sqes && m_sqes != MAP_FAILED)
+			munmap(m_sqes, m_sqessize);
+		if (m_cqring && m_cqring != MAP_FAILED && m_cqring != m_sqring)
+			munmap(m_cqring, m_cqringsize);
+		if (m_sqring && m_sqring != MAP_FAILED)
+			munmap(m_sqring, m_sqringsize);
+	}
+
+	void _uringclose()
+	{
+		bool notified;
+		{
+			// 等待所有读取完成，再提交一个空操作通知完成线程退出，完成线程已因出错退出时不需要通知
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return m_inflight == 0; });
+			notified = m_broken || _uringpush([](io_uring_sqe* sqe) { sqe->opcode = IORING_OP_NOP; sqe->user_data = 0; }) == 0;
+		}
+		m_fallback.reset();
+		if (!notified)
+		{
+			// 无法通知完成线程，它一直阻塞在io_uring_enter中，只能放弃它，映射的内存和fd也不能释放
+			m_reaper.detach();
+			return;
+		}
+		m_reaper.join();
+		_uringunmap();
+		close(m_ringfd);
+		m_ringfd = -1;
+	}
+
+	// 填写并提交一个请求，调用时必须持有m_mutex，成功返回0，失败返回错误码
+	// 失败时如果内核还没有取走这一项就撤回它，否则请求已经提交，仍然会在完成队列中出现
+	template <typename Fill>
+	int _uringpush(Fill&& fill)
+	{
+		auto tail = *m_sqtail;
+		auto index = tail & m_sqmask;
+		auto sqe = &m_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		fill(sqe);
+		m_sqarray[index] = index;
+		__atomic_store_n(m_sqtail, tail + 1, __ATOMIC_RELEASE);
+		for (;;)
+		{
+			if (_enter(m_ringfd, 1, 0, 0) >= 0)
+			{
+				return 0;
+			}
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				break;
+			}
+		}
+		int error = errno;
+		if (__atomic_load_n(m_sqhead, __ATOMIC_ACQUIRE) != tail + 1)
+		{
+			__atomic_store_n(m_sqtail, tail, __ATOMIC_RELEASE);
+			return error;
+		}
+		return 0;
+	}
+
+	int _uringsubmit(Request* req)
+	{
+		req->iov.iov_base = req->buf;
+		req->iov.iov_len = req->len;
+		return _uringpush([req](io_uring_sqe* sqe) {
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fileno(req->file);
+			sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+			sqe->len = 1;
+			sqe->off = req->pos;
+			sqe->user_data = (uint64_t)(uintptr_t)req;
+		});
+	}
+
+	// 不能通过io_uring完成的请求改为在线程池中使用pread读取剩余部分，调用时必须持有m_mutex
+	// 请求仍然计入m_inflight，析构时同样会等待它完成
+	void _uringfallback(Request* req)
+	{
+		if (!m_fallback)
+		{
+			m_fallback = std::make_unique<PckThreadPool>(1);
+		}
+		m_fallback->Post([this, req] {
+			int error = MyPRead(req->file, req->buf, req->len, req->pos) == req->len ? 0 : EIO;
+			_uringcomplete(req, error);
+		});
+	}
+
+	void _uringcomplete(Request* req, int error)
+	{
+		try
+		{
+			req->callback(error);
+		}
+		catch (...)
+		{
+		}
+		delete req;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_inflight;
+		}
+		m_cond.notify_all();
+	}
+
+	// 等待完成事件出错时，io_uring已经不可用，所有未完成的请求和之后的请求都改为使用pread
+	void _uringbroken()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_broken = true;
+			for (auto req : m_pending)
+			{
+				_uringfallback(req);
+			}
+			m_pending.clear();
+		}
+		m_cond.notify_all();
+	}
+
+	void _uringreap()
+	{
+		for (;;)
+		{
+			if (_enter(m_ringfd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				_uringbroken();
+				return;
+			}
+			auto head = *m_cqhead;
+			auto tail = __atomic_load_n(m_cqtail, __ATOMIC_ACQUIRE);
+			while (head != tail)
+			{
+				auto cqe = m_cqes[head & m_cqmask];
+				__atomic_store_n(m_cqhead, ++head, __ATOMIC_RELEASE);
+				auto req = (Request*)(uintptr_t)cqe.user_data;
+				if (!req)
+				{
+					return;
+				}
+				if (cqe.res == -EINTR || cqe.res == -EAGAIN || (cqe.res > 0 && (uint32_t)cqe.res < req->len))
+				{
+					// 读取不完整，继续读取剩余部分
+					if (cqe.res > 0)
+					{
+						req->buf += cqe.res;
+						req->len -= cqe.res;
+						req->pos += cqe.res;
+					}
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (_uringsubmit(req) != 0)
+					{
+						m_pending.erase(req);
+						_uringfallback(req);
+					}
+					continue;
+				}
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_pending.erase(req);
+				}
+				_uringcomplete(req, cqe.res < 0 ? -cqe.res : ((uint32_t)cqe.res == req->len ? 0 : EIO));
+			}
+		}
+	}
+
+	int m_ringfd = -1;
+	void* m_sqring = nullptr;
+	void* m_cqring = nullptr;
+	io_uring_sqe* m_sqes = nullptr;
+	size_t m_sqringsize = 0;
+	size_t m_cqringsize = 0;
+	size_t m_sqessize = 0;
+	unsigned* m_sqhead = nullptr;
+	unsigned* m_sqtail = nullptr;
+	unsigned* m_sqarray = nullptr;
+	unsigned m_sqmask = 0;
+	unsigned m_sqentries = 0;
+	unsigned* m_cqhead = nullptr;
+	unsigned* m_cqtail = nullptr;
+	unsigned m_cqmask = 0;
+	io_uring_cqe* m_cqes = nullptr;
+	std::thread m_reaper;
+	// 保护提交队列、m_inflight、m_pending和m_fallback
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	unsigned m_inflight = 0;
+	// 已提交给io_uring还没有完成的请求，io_uring出错时改为使用pread完成
+	std::unordered_set<Request*> m_pending;
+	std::unique_ptr<PckThreadPool> m_fallback;
+	bool m_broken = false;
+#endif
+};
@@ -0,0 +1,154 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <zlib.h>
+#include "pckdef.h"
+#include "pckfile.h"
+#include "pckdeflater.h"
+#include "pcknameindex.h"
+
+// 提交事务期间的压缩统计，多个工作线程同时累加
+class PckCompressStats
+{
+public:
+	void Clear() noexcept
+	{
+		m_compressed = 0;
+		m_stored = 0;
+		m_probed = 0;
+		m_databytes = 0;
+		m_writtenbytes = 0;
+		m_deduped = 0;
+		m_dedupbytes = 0;
+		m_nanoseconds = 0;
+	}
+
+	// 写入一个文件的数据后调用
+	void Add(bool compressed, bool probed, uint64_t datasize, uint64_t written) noexcept
+	{
+		(compressed ? m_compressed : m_stored).fetch_add(1, std::memory_order_relaxed);
+		if (probed)
+			m_probed.fetch_add(1, std::memory_order_relaxed);
+		m_databytes.fetch_add(datasize, std::memory_order_relaxed);
+		m_writtenbytes.fetch_add(written, std::memory_order_relaxed);
+	}
+
+	// 文件共享已有的数据，没有写入时调用
+	void AddDeduped(uint64_t datasize) noexcept
+	{
+		m_deduped.fetch_add(1, std::memory_order_relaxed);
+		m_dedupbytes.fetch_add(datasize, std::memory_order_relaxed);
+	}
+
+	void AddTime(uint64_t nanoseconds) noexcept
+	{
+		m_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+	}
+
+	PckFile::CompressReport Report() const noexcept
+	{
+		PckFile::CompressReport report;
+		report.compressed = m_compressed.load(std::memory_order_relaxed);
+		report.stored = m_stored.load(std::memory_order_relaxed);
+		report.probed = m_probed.load(std::memory_order_relaxed);
+		report.databytes = m_databytes.load(std::memory_order_relaxed);
+		report.writtenbytes = m_writtenbytes.load(std::memory_order_relaxed);
+		report.deduped = m_deduped.load(std::memory_order_relaxed);
+		report.dedupbytes = m_dedupbytes.load(std::memory_order_relaxed);
+		report.seconds = m_nanoseconds.load(std::memory_order_relaxed) / 1e9;
+		return report;
+	}
+
+private:
+	std::atomic<uint32_t> m_compressed { 0 };
+	std::atomic<uint32_t> m_stored { 0 };
+	std::atomic<uint32_t> m_probed { 0 };
+	std::atomic<uint64_t> m_databytes { 0 };
+	std::atomic<uint64_t> m_writtenbytes { 0 };
+	std::atomic<uint32_t> m_deduped { 0 };
+	std::atomic<uint64_t> m_dedupbytes { 0 };
+	std::atomic<uint64_t> m_nanoseconds { 0 };
+};
+
+// 按压缩策略压缩文件数据
+class PckCompressor
+{
+public:
+	// 文件使用的压缩等级，按扩展名查找，找不到时使用默认等级
+	static int GetLevel(const PckFile::CompressPolicy& policy, std::string_view filename) noexcept
+	{
+		auto dot = filename.find_last_of('.');
+		auto sep = filename.find_last_of('\\');
+		if (dot != std::string_view::npos && (sep == std::string_view::npos || dot > sep))
+		{
+			auto ext = filename.substr(dot + 1);
+			for (auto& e : policy.extlevels)
+			{
+				if (PckNameIndex::EqualIgnoreCase(e.first, ext))
+					return e.second;
+			}
+		}
+		return policy.level;
+	}
+
+	// 压缩data，返回true表示应保存out中的压缩数据，返回false表示应保存原始数据，此时out被清空
+	// policy为空时使用zlib的默认等级并总是保存压缩数据，与不使用压缩策略时的结果一致
+	// probed返回是否因试压缩效果太差而没有压缩整个文件
+	static bool Compress(const std::vector<uint8_t>& data, std::vector<uint8_t>& out, std::string_view filename,
+		const PckFile::CompressPolicy* policy, bool& probed)
+	{
+		bool compressed = false;
+		probed = false;
+		auto level = policy ? GetLevel(*policy, filename) : Z_DEFAULT_COMPRESSION;
+		if (data.size() >= PCK_BEGINCOMPRESS_SIZE && level != 0)
+		{
+			auto& deflater = GetDeflater(level);
+			if (policy && policy->probesize > 0 && data.size() / 2 >= policy->probesize)
+			{
+				// 只压缩开头的一段，已经压缩不动的数据（图片、音频等）不必再压缩整个文件
+				out.resize(compressBound(policy->probesize));
+				auto len = (uint32_t)out.size();
+				if (!deflater.Deflate(out.data(), len, data.data(), policy->probesize))
+				{
+					throw std::runtime_error("压缩数据失败");
+				}
+				probed = len > policy->probesize * policy->threshold;
+			}
+			if (!probed)
+			{
+				out.resize(compressBound(data.size()));
+				auto len = (uint32_t)out.size();
+				if (!deflater.Deflate(out.data(), len, data.data(), (uint32_t)data.size()))
+				{
+					throw std::runtime_error("压缩数据失败");
+				}
+				out.resize(len);
+				compressed = !policy || len <= data.size() * policy->threshold;
+			}
+		}
+		if (!compressed)
+		{
+			std::vector<uint8_t>().swap(out);
+		}
+		return compressed;
+	}
+
+private:
+	// 每个线程、每个压缩等级各一个可重复使用的压缩器，zlib的默认等级即为6
+	static PckDeflater& GetDeflater(int level)
+	{
+		thread_local std::unique_ptr<PckDeflater> deflaters[10];
+		if (level < 0 || level > 9)
+			level = level < 0 ? 6 : 9;
+		auto& p = deflaters[level];
+		if (!p)
+			p = std::make_unique<PckDeflater>(level);
+		return *p;
+	}
+};
@@ -0,0 +1,178 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+// 解压后的文件数据缓存，按数据在文件中的位置和压缩数据大小查找，超过容量时淘汰最久未使用的数据
+// 分成多个分片，每个分片有独立的锁，多线程读取时互不影响
+class PckDataCache
+{
+public:
+	typedef std::shared_ptr<const std::vector<uint8_t>> Data;
+
+	explicit PckDataCache(size_t capacity) : m_capacity(capacity)
+	{
+	}
+
+	// 查找数据，找不到返回nullptr
+	Data Find(uint64_t offset, uint32_t size)
+	{
+		Key key { offset, size };
+		auto& shard = _getshard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(key);
+		if (it == shard.map.end())
+		{
+			++m_misses;
+			return nullptr;
+		}
+		++m_hits;
+		// 移到链表头部
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+		return it->second->data;
+	}
+
+	// 插入数据，超过分片容量的数据不缓存
+	void Insert(uint64_t offset, uint32_t size, Data data)
+	{
+		Key key { offset, size };
+		auto cost = _cost(*data);
+		auto& shard = _getshard(key);
+		if (cost > m_capacity / ShardCount)
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(key);
+		if (it != shard.map.end())
+		{
+			// 其他线程已经插入了相同的数据
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			return;
+		}
+		shard.lru.push_front({ key, std::move(data) });
+		shard.map.emplace(key, shard.lru.begin());
+		shard.bytes += cost;
+		while (shard.bytes > m_capacity / ShardCount)
+		{
+			auto& last = shard.lru.back();
+			shard.bytes -= _cost(*last.data);
+			shard.map.erase(last.key);
+			shard.lru.pop_back();
+		}
+	}
+
+	void Erase(uint64_t offset, uint32_t size)
+	{
+		Key key { offset, size };
+		auto& shard = _getshard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(key);
+		if (it != shard.map.end())
+		{
+			shard.bytes -= _cost(*it->second->data);
+			shard.lru.erase(it->second);
+			shard.map.erase(it);
+		}
+	}
+
+	void Clear()
+	{
+		for (auto& shard : m_shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.lru.clear();
+			shard.map.clear();
+			shard.bytes = 0;
+		}
+	}
+
+	size_t Capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	uint64_t Hits() const noexcept
+	{
+		return m_hits;
+	}
+
+	uint64_t Misses() const noexcept
+	{
+		return m_misses;
+	}
+
+	// 当前缓存的数据量和数据个数
+	void GetUsage(size_t& bytes, size_t& count)
+	{
+		bytes = 0;
+		count = 0;
+		for (auto& shard : m_shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			bytes += shard.bytes;
+			count += shard.map.size();
+		}
+	}
+
+private:
+	PckDataCache(const PckDataCache&) = delete;
+	void operator=(const PckDataCache&) = delete;
+
+	static constexpr size_t ShardCount = 16;
+
+	struct Key
+	{
+		uint64_t offset;
+		uint32_t size;
+
+		bool operator==(const Key& key) const noexcept
+		{
+			return offset == key.offset && size == key.size;
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const noexcept
+		{
+			uint64_t h = (key.offset ^ ((uint64_t)key.size << 40)) * 0x9E3779B97F4A7C15ull;
+			return (size_t)(h ^ (h >> 32));
+		}
+	};
+
+	struct Entry
+	{
+		Key key;
+		Data data;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::list<Entry> lru;
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map;
+		size_t bytes = 0;
+	};
+
+	Shard& _getshard(const Key& key)
+	{
+		return m_shards[(KeyHash()(key) >> 7) % ShardCount];
+	}
+
+	// 每项数据占用的内存，包括链表和哈希表节点的大致开销
+	static size_t _cost(const std::vector<uint8_t>& data)
+	{
+		return data.size() + 128;
+	}
+
+	size_t m_capacity;
+	Shard m_shards[ShardCount];
+	std::atomic<uint64_t> m_hits { 0 };
+	std::atomic<uint64_t> m_misses { 0 };
+};
@@ -0,0 +1,109 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// 按内容哈希查找已写入文件包的数据，使内容相同的文件共享同一份压缩数据
+// 提交事务时工作线程通过Claim决定是否需要压缩，写入线程通过Find和Insert查找和登记数据的位置
+class PckDedupTable
+{
+public:
+	struct Blob
+	{
+		uint64_t offset;
+		uint32_t compresssize;
+	};
+
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_blobs.clear();
+		m_byoffset.clear();
+	}
+
+	// 清除上次提交留下的、还没有写入数据的登记
+	void ResetClaims()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto it = m_blobs.begin(); it != m_blobs.end();)
+		{
+			if (it->second.offset == npos)
+				it = m_blobs.erase(it);
+			else
+				++it;
+		}
+	}
+
+	// 登记即将写入的内容，第一次登记返回true，由调用者压缩和写入
+	// 之后相同的内容返回false，可以跳过压缩，写入时再通过Find确认
+	bool Claim(uint64_t hash, uint32_t size)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_blobs.emplace(Key { hash, size }, Blob { npos, 0 }).second;
+	}
+
+	// 查找已写入的相同内容，哈希可能碰撞，调用者需要比较数据
+	bool Find(uint64_t hash, uint32_t size, Blob& blob) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_blobs.find(Key { hash, size });
+		if (it == m_blobs.end() || it->second.offset == npos)
+			return false;
+		blob = it->second;
+		return true;
+	}
+
+	// 登记已写入的数据的位置，相同内容已有位置时保留原来的
+	void Insert(uint64_t hash, uint32_t size, const Blob& blob)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Key key { hash, size };
+		auto it = m_blobs.find(key);
+		if ((it != m_blobs.end() && it->second.offset != npos) || m_byoffset.count(blob.offset))
+			return;
+		m_blobs.insert_or_assign(key, blob);
+		m_byoffset.emplace(blob.offset, key);
+	}
+
+	bool Contains(uint64_t offset) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_byoffset.count(offset) != 0;
+	}
+
+	// 数据被释放或覆盖后移除登记
+	void Erase(uint64_t offset)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_byoffset.find(offset);
+		if (it == m_byoffset.end())
+			return;
+		m_blobs.erase(it->second);
+		m_byoffset.erase(it);
+	}
+
+private:
+	static constexpr uint64_t npos = UINT64_MAX;
+
+	struct Key
+	{
+		uint64_t hash;
+		uint32_t size;
+		bool operator==(const Key& other) const noexcept
+		{
+			return hash == other.hash && size == other.size;
+		}
+	};
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const noexcept
+		{
+			return (size_t)(key.hash ^ ((uint64_t)key.size << 32));
+		}
+	};
+
+	mutable std::mutex m_mutex;
+	std::unordered_map<Key, Blob, KeyHash> m_blobs;
+	std::unordered_map<uint64_t, Key> m_byoffset;
+};
@@ -0,0 +1,50 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <zlib.h>
+
+// 可重复使用的zlib压缩器，避免每次调用compress2都重新分配压缩状态
+// 压缩结果与使用相同压缩等级的compress2完全一致
+class PckDeflater
+{
+public:
+	explicit PckDeflater(int level = Z_DEFAULT_COMPRESSION)
+	{
+		if (deflateInit(&m_stream, level) != Z_OK)
+		{
+			throw std::runtime_error("初始化压缩器失败");
+		}
+	}
+
+	~PckDeflater()
+	{
+		deflateEnd(&m_stream);
+	}
+
+	// 压缩为完整的zlib数据流，成功返回true，destlen返回实际压缩的长度
+	// 与compress2的行为一致：destlen至少为compressBound(srclen)时总能成功
+	bool Deflate(void* dest, uint32_t& destlen, const void* src, uint32_t srclen)
+	{
+		if (deflateReset(&m_stream) != Z_OK)
+		{
+			return false;
+		}
+		m_stream.next_in = (Bytef*)src;
+		m_stream.avail_in = srclen;
+		m_stream.next_out = (Bytef*)dest;
+		m_stream.avail_out = destlen;
+		if (deflate(&m_stream, Z_FINISH) != Z_STREAM_END)
+		{
+			return false;
+		}
+		destlen = (uint32_t)m_stream.total_out;
+		return true;
+	}
+
+private:
+	PckDeflater(const PckDeflater&) = delete;
+	void operator=(const PckDeflater&) = delete;
+
+	z_stream m_stream {};
+};
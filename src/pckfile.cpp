@@ -1,6 +1,9 @@
 ﻿#include "pckfile.h"
 #include <cstring>
 #include <tuple>
+#include <numeric>
+#include <unordered_set>
+#include <unordered_map>
 #include <mutex>
 #include <thread>
 #include <atomic>
@@ -14,6 +17,21 @@
 #include "pckfileio.h"
 #include "pckpendingitem.h"
 #include "pckhelper.h"
+#include "pcknameindex.h"
+#include "pckinflater.h"
+#include "pckdeflater.h"
+#include "pckmmap.h"
+#include "pckindexcache.h"
+#include "pckindextable.h"
+#include "pckreader.h"
+#include "pckdatacache.h"
+#include "pckthreadpool.h"
+#include "pckasyncio.h"
+#include "pckfreespace.h"
+#include "pckaccesstrace.h"
+#include "pckcompressor.h"
+#include "pckdedup.h"
+#include "pckhash.h"
 
 class PckFile::PckFileImpl
 {
@@ -21,29 +39,124 @@ public:
 	PckFileImpl(PckFile* pck);
 	void ReadHead();
 	void ReadTail();
-	void ReadIndexTable();
-	uint32_t ReadIndex(_PckItemIndex* pindex);
+	void ReadIndexTable(bool lazy = false);
+	void DecodeItem(size_t i);
+	void DecodeLazyItem(size_t i, PckInflater& inflater);
+	void DecodeAllItems();
+	void FinishLazyDecode();
+	void ResetItems(size_t count);
+	void AppendItem(std::string_view name, uint64_t offset, uint32_t size, uint32_t compresssize);
+	void MarkItemDeleted(uint32_t index);
+	bool IsItemDeleted(uint32_t index) const;
+	void SweepDeletedItems();
+	static uint32_t ScanIndex(const uint8_t* p, size_t avail);
+	static void DecodeIndex(PckInflater& inflater, const uint8_t* p, uint32_t len, _PckItemIndex* pindex);
+	static void DecodeData(const uint8_t* src, uint32_t srclen, uint8_t* dest, uint32_t destlen);
+	void ReadItemData(const PckItem& item, uint8_t* dest);
+	void InvalidateItemData(uint32_t index);
+
+	// 每个线程独立的压缩数据缓冲区，超过这个大小的数据使用临时缓冲区，避免长期占用大量内存
+	static constexpr uint32_t MaxScratchSize = 4 * 1024 * 1024;
+	// 解压时超过这个大小的文件使用流式读取，避免同时占用完整的压缩数据和解压数据
+	static constexpr uint32_t StreamExtractSize = 16 * 1024 * 1024;
+	static constexpr uint32_t StreamChunkSize = 1024 * 1024;
+	// 提交事务时预先读取和压缩的数据量上限
+	static constexpr uint64_t CommitWindowSize = 256 * 1024 * 1024;
+	// 批量读取时每轮读取的压缩数据量，每轮结束后把已完成的数据交给调用者，限制内存占用
+	static constexpr uint64_t BatchRoundSize = 64 * 1024 * 1024;
+	// 整理数据区时每次复制的数据量，相邻的文件合并为一段移动，每段不超过这个大小（单个文件除外）
+	static constexpr uint32_t CompactChunkSize = 4 * 1024 * 1024;
+	// 整理数据区时最多移动这么多数据就把索引写入文件，中断时已移动的部分不会丢失
+	static constexpr uint64_t CompactBatchSize = 64 * 1024 * 1024;
+	void MoveData(uint64_t src, uint64_t dst, uint64_t len, std::vector<uint8_t>& buf);
+	void SwitchIndexTable(uint64_t addr);
+	bool IndexTableOverlaps(uint64_t addr) const;
+	// 重建时每次复制的数据量上限，也是分配给工作线程的最小单位
+	static constexpr uint32_t RebuildChunkSize = 16 * 1024 * 1024;
+	// 重建时每轮复制的数据量，每轮结束后调用一次回调
+	static constexpr uint64_t RebuildRoundSize = 256 * 1024 * 1024;
+	static void RebuildTo(PckFileImpl& src, const std::vector<uint32_t>& order, const std::string& newname, bool overwrite, ProcessCallback callback);
+	static void CopyData(PckFileIO& src, uint64_t srcpos, PckFileIO& dst, uint64_t dstpos, uint32_t len, std::vector<uint8_t>& buf);
 	void WriteHead();
 	void WriteTail();
-	void WriteIndexTable();
-	uint32_t WriteIndex(const _PckItemIndex& index);
+	void WriteIndexTable(uint64_t oldaddr);
+	size_t EncodeIndexTable();
+	static uint32_t EncodeIndex(const _PckItemIndex& index, uint8_t* out);
+	void EnsureIndexRecords();
 	void AddPendingItem(std::unique_ptr<PckPendingItem>&& item);
 	static void EnumDir(filesystem::path dir, filesystem::path base, std::function<void(std::string diskpath, std::string pckpath)>);
 	void CalcIndexTableAddr();
+	uint64_t DataEnd() const;
+	uint64_t AllocateData(uint32_t size);
+	bool LoadIndexCache();
+	void SaveIndexCache();
+	void GetIndexCacheStamp(PckIndexCacheHead& head);
+	uint32_t FindItem(std::string_view filename);
+	void BuildNameIndex();
 
 	PckFile* m_pck;
 	PckFileIO m_file;
 	_PckHead m_head = { 0 };
 	_PckTail m_tail = { 0 };
+	// 索引表，m_items中的PckItem都是指向它的句柄，且m_items[i]总是指向第i项
+	PckIndexTable m_table;
 	std::vector<PckItem> m_items;
 	uint64_t m_indextableaddr = 0;
 	uint64_t m_indextablesize = 0;
 	uint64_t m_totalsize = 0;
 	uint64_t m_totalcompresssize = 0;
+	// 文件名哈希表，保存m_items中的序号
+	PckNameIndex m_nameindex;
+	std::string_view ItemName(uint32_t i) const { return m_table.Name(i); }
+	// 解压数据缓存，为空表示不使用缓存
+	std::unique_ptr<PckDataCache> m_datacache;
+	// 数据区中的空洞，在第一次提交事务时建立，之后随每次提交更新
+	PckFreeSpace m_freespace;
+	// 文件读取顺序的记录，默认不记录
+	PckAccessTrace m_trace;
+	void RecordAccess(const PckItem& item)
+	{
+		if (m_trace.IsActive())
+			m_trace.Record(item.GetFileName());
+	}
+	std::vector<uint32_t> UniqueItems();
+
+	// 延迟解压索引相关，m_lazybuf保存整个索引表的原始数据，m_lazyoffsets为每条索引在其中的偏移
+	std::atomic<bool> m_lazy { false };
+	std::vector<uint8_t> m_lazybuf;
+	std::vector<uint32_t> m_lazyoffsets;
+	std::unique_ptr<std::atomic<bool>[]> m_decoded;
+	// 已按顺序加入哈希表的文件数
+	uint32_t m_lazynamed = 0;
+	std::mutex m_lazymutex;
+	std::unique_ptr<PckInflater> m_lazyinflater;
 
 	// 事务相关
 	std::vector<std::unique_ptr<PckPendingItem>> m_pendingitems;
 	bool m_trans = false;
+	void CommitTransaction(ProcessCallback callback, const CompressPolicy* policy);
+	void AddBufferItem(const void* buf, uint32_t len, const std::string& filename, std::shared_ptr<const CompressPolicy> policy);
+	void AddFileItem(const std::string& diskfilename, const std::string& pckfilename, std::shared_ptr<const CompressPolicy> policy);
+	static CompressReport CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname, bool overwrite, ProcessCallback callback, const CompressPolicy* policy);
+	// 最近一次提交事务的压缩统计
+	PckCompressStats m_compressstats;
+	// 按内容去重时已知内容哈希的数据，跨提交保留，数据被释放或移动时移除
+	PckDedupTable m_dedup;
+	void HashExistingData();
+	bool FindSharedData(PckPendingItem* item, const std::vector<uint8_t>& data, PckDedupTable::Blob& blob);
+	void ReadBlob(uint64_t offset, uint32_t compresssize, uint8_t* dest, uint32_t datasize);
+	void FreeData(uint64_t offset, uint32_t size);
+	uint64_t StoredDataSize() const;
+	// 提交事务时标记删除的项，全部操作完成后一次性移除，期间各项的序号不变
+	std::vector<uint8_t> m_deletemarks;
+	size_t m_deletecount = 0;
+
+	// 异步读取相关，在第一次异步读取时创建
+	// 必须放在最后，析构时先等待未完成的读取，再等待解压，之后才能释放其他成员
+	void StartAsync();
+	std::once_flag m_asyncflag;
+	std::unique_ptr<PckThreadPool> m_inflatepool;
+	std::unique_ptr<PckAsyncIO> m_asyncio;
 };
 
 PckFile::PckFile()
@@ -57,13 +170,32 @@ PckFile::~PckFile()
 }
 
 std::shared_ptr<PckFile> PckFile::Open(const std::string& filename, bool readonly)
+{
+	OpenOptions options;
+	options.readonly = readonly;
+	return Open(filename, options);
+}
+
+std::shared_ptr<PckFile> PckFile::Open(const std::string& filename, const OpenOptions& options)
 {
 	auto pck = std::shared_ptr<PckFile>(new PckFile());
 	auto& p = pck->pImpl;
-	p->m_file.Open(filename.c_str(), readonly);
+	p->m_file.Open(filename.c_str(), options.readonly);
+	if (options.mmap && options.readonly)
+	{
+		p->m_file.Map();
+	}
+	pck->SetDataCacheCapacity(options.datacache);
 	p->ReadHead();
 	p->ReadTail();
-	p->ReadIndexTable();
+	if (!options.indexcache || !p->LoadIndexCache())
+	{
+		p->ReadIndexTable(options.lazyindex);
+		if (options.indexcache && !options.lazyindex)
+		{
+			p->SaveIndexCache();
+		}
+	}
 	return pck;
 }
 
@@ -91,20 +223,17 @@ uint32_t PckFile::GetFileCount() const noexcept
 
 const PckItem& PckFile::GetSingleFileItem(const std::string& filename) const
 {
-	auto s = NormalizePckFileName(filename);
-	for (auto i = pImpl->m_items.begin(); i != pImpl->m_items.end(); ++i)
+	auto i = pImpl->FindItem(NormalizePckFileName(filename));
+	if (i == PckNameIndex::npos)
 	{
-		std::string s1 = std::string(i->GetFileName());
-		if (StringHelper::CompareIgnoreCase(s1, s) == 0)
-		{
-			return *i;
-		}
+		throw std::runtime_error("找不到指定的文件");
 	}
-	throw std::runtime_error("找不到指定的文件");
+	return pImpl->m_items[i];
 }
 
 const PckItem& PckFile::GetSingleFileItem(uint32_t i) const
 {
+	pImpl->DecodeItem(i);
 	return pImpl->m_items[i];
 }
 
@@ -115,42 +244,408 @@ std::vector<uint8_t> PckFile::GetSingleFileData(const std::string& filename)
 
 std::vector<uint8_t> PckFile::GetSingleFileData(const PckItem& item)
 {
-	const _PckItemIndex& index = item.m_index;
-	auto compressdata = GetSingleFileCompressData(item);
-	std::vector<uint8_t> buf(index.dwFileDataSize);
-	uLongf destLen = index.dwFileDataSize;
-	auto ret = uncompress((Bytef*)buf.data(), &destLen, (Bytef*)compressdata.data(), (uLongf)compressdata.size());
-	if (ret != Z_OK)
+	std::vector<uint8_t> buf(item.GetDataSize());
+	GetSingleFileData(item, std::span<uint8_t>(buf));
+	return buf;
+}
+
+uint32_t PckFile::GetSingleFileData(const PckItem& item, std::span<uint8_t> buf)
+{
+	pImpl->RecordAccess(item);
+	auto datasize = item.GetDataSize();
+	if (buf.size() < datasize)
+	{
+		throw std::runtime_error("缓冲区太小");
+	}
+	if (pImpl->m_datacache)
+	{
+		auto data = GetSingleFileDataShared(item);
+		memcpy(buf.data(), data->data(), datasize);
+	}
+	else
+	{
+		pImpl->ReadItemData(item, buf.data());
+	}
+	return datasize;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> PckFile::GetSingleFileDataShared(const PckItem& item)
+{
+	pImpl->RecordAccess(item);
+	auto& cache = pImpl->m_datacache;
+	auto offset = item.m_table->Offset(item.m_index);
+	auto compresssize = item.GetCompressDataSize();
+	if (cache)
 	{
-		if (index.dwFileCompressDataSize != index.dwFileDataSize)
+		if (auto data = cache->Find(offset, compresssize))
 		{
-			throw std::runtime_error("解压数据失败");
+			return data;
+		}
+	}
+	auto data = std::make_shared<std::vector<uint8_t>>(item.GetDataSize());
+	pImpl->ReadItemData(item, data->data());
+	if (cache)
+	{
+		cache->Insert(offset, compresssize, data);
+	}
+	return data;
+}
+
+void PckFile::GetSingleFileData(const PckItem& item, std::vector<uint8_t>& buf)
+{
+	buf.resize(item.GetDataSize());
+	GetSingleFileData(item, std::span<uint8_t>(buf));
+}
+
+std::vector<uint8_t> PckFile::GetSingleFileCompressData(const PckItem& item)
+{
+	std::vector<uint8_t> buf(item.GetCompressDataSize());
+	GetSingleFileCompressData(item, std::span<uint8_t>(buf));
+	return buf;
+}
+
+uint32_t PckFile::GetSingleFileCompressData(const PckItem& item, std::span<uint8_t> buf)
+{
+	if (buf.size() < item.GetCompressDataSize())
+	{
+		throw std::runtime_error("缓冲区太小");
+	}
+	return GetSingleFileCompressData(item, 0, buf);
+}
+
+uint32_t PckFile::GetSingleFileCompressData(const PckItem& item, uint32_t pos, std::span<uint8_t> buf)
+{
+	auto compresssize = item.GetCompressDataSize();
+	if (pos > compresssize)
+	{
+		throw std::runtime_error("读取位置超出数据范围");
+	}
+	if (pos == 0)
+	{
+		pImpl->RecordAccess(item);
+	}
+	uint32_t len = std::min<uint64_t>(buf.size(), compresssize - pos);
+	auto offset = item.m_table->Offset(item.m_index) + pos;
+	if (pImpl->m_file.IsMapped())
+	{
+		auto view = pImpl->m_file.View(offset, len);
+		memcpy(buf.data(), view.data(), len);
+	}
+	else
+	{
+		pImpl->m_file.ReadAt(offset, buf.data(), len);
+	}
+	return len;
+}
+
+std::span<const uint8_t> PckFile::GetSingleFileCompressView(const PckItem& item)
+{
+	pImpl->RecordAccess(item);
+	return pImpl->m_file.View(item.m_table->Offset(item.m_index), item.GetCompressDataSize());
+}
+
+void PckFile::ReadBatch(const std::vector<const PckItem*>& items, BatchSink sink)
+{
+	ReadBatch(items, sink, BatchOptions());
+}
+
+std::vector<std::vector<uint8_t>> PckFile::ReadBatch(const std::vector<const PckItem*>& items)
+{
+	return ReadBatch(items, BatchOptions());
+}
+
+void PckFile::ReadBatch(const std::vector<const PckItem*>& items, BatchSink sink, const BatchOptions& options)
+{
+	if (pImpl->m_trace.IsActive())
+	{
+		for (auto item : items)
+		{
+			pImpl->RecordAccess(*item);
+		}
+	}
+
+	// 按数据位置排序
+	std::vector<uint32_t> order(items.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	auto offset = [&](uint32_t i) { return items[i]->m_table->Offset(items[i]->m_index); };
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return offset(a) < offset(b); });
+
+	// 合并为多段连续读取，每段包含order中[first, last)的文件
+	struct Run
+	{
+		uint64_t begin;
+		uint64_t end;
+		uint32_t first;
+		uint32_t last;
+	};
+	std::vector<Run> runs;
+	// order中第i个文件所在的段
+	std::vector<uint32_t> runof(order.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+	{
+		auto begin = offset(order[i]);
+		auto end = begin + items[order[i]]->GetCompressDataSize();
+		if (!runs.empty())
+		{
+			auto& run = runs.back();
+			if (begin <= run.end + options.maxgap && std::max(end, run.end) - run.begin <= options.maxread)
+			{
+				run.end = std::max(end, run.end);
+				run.last = i + 1;
+				runof[i] = (uint32_t)runs.size() - 1;
+				continue;
+			}
+		}
+		runof[i] = (uint32_t)runs.size();
+		runs.push_back({ begin, end, i, i + 1 });
+	}
+
+	std::vector<std::vector<uint8_t>> results(items.size());
+	std::vector<bool> done(items.size());
+	// 本轮每一段数据的位置，未映射时读到runbufs中，保留到下一轮重复使用
+	std::vector<const uint8_t*> rundata;
+	std::vector<std::vector<uint8_t>> runbufs;
+	size_t next = 0;
+	for (size_t r = 0; r < runs.size();)
+	{
+		// 每轮处理若干段，总数据量不超过BatchRoundSize（至少一段）
+		auto first = r;
+		uint64_t bytes = 0;
+		do
+		{
+			bytes += runs[r].end - runs[r].begin;
+			++r;
+		} while (r < runs.size() && bytes + runs[r].end - runs[r].begin <= PckFileImpl::BatchRoundSize);
+
+		// 先并行读取本轮的每一段，再按文件并行解压，一段中的小文件很多时也能用满所有线程
+		rundata.resize(r - first);
+		if (runbufs.size() < r - first)
+		{
+			runbufs.resize(r - first);
+		}
+		ParallelFor(r - first, 1, [&](size_t begin, size_t end) {
+			for (auto k = begin; k < end; ++k)
+			{
+				auto& run = runs[first + k];
+				auto len = (uint32_t)(run.end - run.begin);
+				if (pImpl->m_file.IsMapped())
+				{
+					rundata[k] = pImpl->m_file.View(run.begin, len).data();
+				}
+				else
+				{
+					runbufs[k].resize(len);
+					pImpl->m_file.ReadAt(run.begin, runbufs[k].data(), len);
+					rundata[k] = runbufs[k].data();
+				}
+			}
+		});
+		auto firstitem = runs[first].first;
+		ParallelFor(runs[r - 1].last - firstitem, 16, [&](size_t begin, size_t end) {
+			for (auto i = firstitem + begin; i < firstitem + end; ++i)
+			{
+				auto index = order[i];
+				auto& run = runs[runof[i]];
+				auto& item = *items[index];
+				results[index].resize(item.GetDataSize());
+				PckFileImpl::DecodeData(rundata[runof[i] - first] + (offset(index) - run.begin), item.GetCompressDataSize(), results[index].data(), item.GetDataSize());
+			}
+		});
+
+		// 按请求的顺序交出已经完成的数据
+		for (auto k = first; k < r; ++k)
+		{
+			for (auto i = runs[k].first; i < runs[k].last; ++i)
+			{
+				done[order[i]] = true;
+			}
+		}
+		while (next < items.size() && done[next])
+		{
+			sink(next, *items[next], results[next]);
+			std::vector<uint8_t>().swap(results[next]);
+			++next;
+		}
+	}
+}
+
+std::vector<std::vector<uint8_t>> PckFile::ReadBatch(const std::vector<const PckItem*>& items, const BatchOptions& options)
+{
+	std::vector<std::vector<uint8_t>> results(items.size());
+	ReadBatch(items, [&](size_t index, const PckItem&, std::vector<uint8_t>& data) {
+		results[index].swap(data);
+	}, options);
+	return results;
+}
+
+void PckFile::ReadAsync(const PckItem& item, AsyncCallback callback)
+{
+	pImpl->RecordAccess(item);
+	pImpl->StartAsync();
+
+	struct Request
+	{
+		PckItem item;
+		AsyncCallback callback;
+		std::vector<uint8_t> compressdata;
+		std::atomic<int> pending { 0 };
+		std::atomic<int> error { 0 };
+	};
+	auto req = std::make_shared<Request>();
+	req->item = item;
+	req->callback = std::move(callback);
+
+	// 解压并调用回调，src为空时使用读取到的压缩数据
+	auto inflate = [req](const uint8_t* src) {
+		std::vector<uint8_t> data;
+		std::exception_ptr error;
+		try
+		{
+			if (req->error)
+			{
+				throw std::runtime_error("读取文件失败");
+			}
+			data.resize(req->item.GetDataSize());
+			PckFileImpl::DecodeData(src ? src : req->compressdata.data(), req->item.GetCompressDataSize(), data.data(), data.size());
+		}
+		catch (...)
+		{
+			data.clear();
+			error = std::current_exception();
+		}
+		std::vector<uint8_t>().swap(req->compressdata);
+		req->callback(req->item, data, error);
+	};
+
+	auto offset = item.m_table->Offset(item.m_index);
+	auto len = item.GetCompressDataSize();
+	auto pool = pImpl->m_inflatepool.get();
+	if (pImpl->m_file.IsMapped())
+	{
+		// 数据已经在内存中，不需要读取
+		auto src = GetSingleFileCompressView(item).data();
+		pool->Post([inflate, src] { inflate(src); });
+		return;
+	}
+
+	PckFileIO::Extent extents[2];
+	auto n = pImpl->m_file.GetExtents(offset, len, extents);
+	req->compressdata.resize(len);
+	if (n == 0)
+	{
+		pool->Post([inflate] { inflate(nullptr); });
+		return;
+	}
+	req->pending = n;
+	uint32_t pos = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		pImpl->m_asyncio->Read(extents[i].file, extents[i].pos, req->compressdata.data() + pos, extents[i].len, [req, pool, inflate](int error) {
+			if (error)
+			{
+				req->error = error;
+			}
+			if (--req->pending == 0)
+			{
+				pool->Post([inflate] { inflate(nullptr); });
+			}
+		});
+		pos += extents[i].len;
+	}
+}
+
+std::future<std::vector<uint8_t>> PckFile::ReadAsync(const PckItem& item)
+{
+	auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+	auto future = promise->get_future();
+	ReadAsync(item, [promise](const PckItem&, std::vector<uint8_t>& data, std::exception_ptr error) {
+		if (error)
+		{
+			promise->set_exception(error);
 		}
 		else
 		{
-			memcpy(buf.data(), compressdata.data(), compressdata.size());
+			promise->set_value(std::move(data));
 		}
+	});
+	return future;
+}
+
+void PckFile::SetDataCacheCapacity(size_t capacity)
+{
+	if (capacity == 0)
+	{
+		pImpl->m_datacache.reset();
+	}
+	else
+	{
+		pImpl->m_datacache = std::make_unique<PckDataCache>(capacity);
 	}
-	return buf;
 }
 
-std::vector<uint8_t> PckFile::GetSingleFileCompressData(const PckItem& item)
+PckFile::DataCacheStats PckFile::GetDataCacheStats() const
 {
-	std::lock_guard<std::mutex> lock(pImpl->m_file.GetMutex());
-	std::vector<uint8_t> buf;
-	auto len = item.m_index.dwFileCompressDataSize;
-	buf.resize(len);
-	pImpl->m_file.Seek(item.m_index.dwAddressOffset);
-	pImpl->m_file.Read(buf.data(), len);
-	return buf;
+	DataCacheStats stats;
+	auto& cache = pImpl->m_datacache;
+	if (cache)
+	{
+		stats.hits = cache->Hits();
+		stats.misses = cache->Misses();
+		stats.capacity = cache->Capacity();
+		cache->GetUsage(stats.bytes, stats.count);
+	}
+	return stats;
+}
+
+uint32_t PckFile::WarmDataCache(const std::string& dirname)
+{
+	if (!pImpl->m_datacache)
+	{
+		return 0;
+	}
+	pImpl->DecodeAllItems();
+
+	auto dir = NormalizePckFileName(dirname);
+	if (!dir.empty())
+	{
+		dir.append("\\");
+	}
+	// 按顺序选出目录下的文件，直到数据量达到缓存容量
+	std::vector<uint32_t> indices;
+	size_t bytes = 0;
+	auto capacity = pImpl->m_datacache->Capacity();
+	auto& table = pImpl->m_table;
+	for (uint32_t i = 0; i < table.Size(); ++i)
+	{
+		auto name = table.Name(i);
+		if (name.size() >= dir.size() && PckNameIndex::EqualIgnoreCase(name.substr(0, dir.size()), dir))
+		{
+			bytes += table.DataSize(i);
+			if (bytes > capacity)
+			{
+				break;
+			}
+			indices.push_back(i);
+		}
+	}
+
+	ParallelFor(indices.size(), 16, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; ++i)
+		{
+			GetSingleFileDataShared(pImpl->m_items[indices[i]]);
+		}
+	});
+	return indices.size();
 }
 
 bool PckFile::FileExists(const std::string& filename) const noexcept
 {
 	try
 	{
-		GetSingleFileItem(filename);
-		return true;
+		return pImpl->FindItem(NormalizePckFileName(filename)) != PckNameIndex::npos;
 	}
 	catch (...)
 	{
@@ -158,8 +653,9 @@ bool PckFile::FileExists(const std::string& filename) const noexcept
 	}
 }
 
-PckFile::PckItemIterator PckFile::begin() const noexcept
+PckFile::PckItemIterator PckFile::begin() const
 {
+	pImpl->DecodeAllItems();
 	return pImpl->m_items.cbegin();
 }
 
@@ -175,6 +671,7 @@ size_t PckFile::size() const noexcept
 
 const PckItem& PckFile::operator[](size_t index) const
 {
+	pImpl->DecodeItem(index);
 	return pImpl->m_items[index];
 }
 
@@ -229,6 +726,8 @@ uint32_t PckFile::Extract_if(const std::string& directory,
 		threads[i].t = std::thread([&](PckFile* pck, std::promise<void>& p) {
 			try
 			{
+				// 每个线程复用同一个数据缓冲区
+				std::vector<uint8_t> data;
 				while (!stopflag)
 				{
 					uint32_t n = index++;
@@ -236,14 +735,30 @@ uint32_t PckFile::Extract_if(const std::string& directory,
 					auto& item = (*pck)[n];
 					if (!fn || fn(item))
 					{
-						auto data = pck->GetSingleFileData(item);
 						filesystem::path p = dir;
 						p /= StringHelper::A2W(item.GetFileName(), loc).c_str();
 						filesystem::create_directories(p.parent_path());  // 如果目录创建失败，将抛出异常
 						std::ofstream f(p.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-						if (f.write((const char*)data.data(), data.size()).fail())
+						if (item.GetDataSize() > PckFileImpl::StreamExtractSize)
+						{
+							// 大文件边读边解压边写出
+							PckItemReader reader(*pck, item);
+							data.resize(PckFileImpl::StreamChunkSize);
+							while (auto len = reader.Read(data.data(), data.size()))
+							{
+								if (f.write((const char*)data.data(), len).fail())
+								{
+									throw std::runtime_error("写出文件失败");
+								}
+							}
+						}
+						else
 						{
-							throw std::runtime_error("写出文件失败");
+							pck->GetSingleFileData(item, data);
+							if (f.write((const char*)data.data(), data.size()).fail())
+							{
+								throw std::runtime_error("写出文件失败");
+							}
 						}
 						++nfiles;
 					}
@@ -300,13 +815,15 @@ uint64_t PckFile::GetFileSize() const noexcept
 	return pImpl->m_head.dwPckSize;
 }
 
-uint64_t PckFile::GetTotalDataSize() const noexcept
+uint64_t PckFile::GetTotalDataSize() const
 {
+	pImpl->DecodeAllItems();
 	return pImpl->m_totalsize;
 }
 
-uint64_t PckFile::GetTotalCompressDataSize() const noexcept
+uint64_t PckFile::GetTotalCompressDataSize() const
 {
+	pImpl->DecodeAllItems();
 	return pImpl->m_totalcompresssize;
 }
 
@@ -315,11 +832,13 @@ uint64_t PckFile::GetIndexTableSize() const noexcept
 	return pImpl->m_indextablesize;
 }
 
-uint64_t PckFile::GetRedundancySize() const noexcept
+uint64_t PckFile::GetRedundancySize() const
 {
+	pImpl->DecodeAllItems();
+	// 多个文件共享的数据只计算一次
 	return pImpl->m_head.dwPckSize - sizeof(_PckHead) - sizeof(_PckTail)
 		- pImpl->m_indextablesize
-		- pImpl->m_totalcompresssize;
+		- pImpl->StoredDataSize();
 }
 
 void PckFile::BeginTransaction() noexcept
@@ -336,131 +855,32 @@ void PckFile::CancelTransaction() noexcept
 
 void PckFile::CommitTransaction(ProcessCallback callback)
 {
-	if (!pImpl->m_trans)
-	{
-		pImpl->m_pendingitems.clear();
-		return;
-	}
-
-	auto total = pImpl->m_pendingitems.size();
-	for (size_t i = 0; i < total; ++i)
-	{
-		auto& p = pImpl->m_pendingitems[i];
-		if (callback && !callback(i, total))
-		{
-			throw std::runtime_error("用户手动取消");
-		}
-		auto t = p->GetType();
-		if (t == PckPendingActionType::Add)
-		{
-			auto p1 = (PckPendingItem_Add*)p.get();
-			auto& compressdata = p1->GetCompressData();
-			auto datasize = p1->GetDataSize();
-			auto& name = p1->GetFileName();
-			pImpl->m_file.Seek(pImpl->m_indextableaddr);
-			pImpl->m_file.Write(compressdata.data(), compressdata.size());
-			
-
-			auto item = PckItem();
-			item.m_pck = shared_from_this();
-			item.m_index.dwAddressOffset = pImpl->m_indextableaddr;
-			item.m_index.dwFileCompressDataSize = compressdata.size();
-			item.m_index.dwFileDataSize = datasize;
-			memset(item.m_index.szFilename, 0, 256);
-			strcpy(item.m_index.szFilename, p1->GetFileName().c_str());
-			pImpl->m_items.emplace_back(std::move(item));
-			
-			pImpl->m_indextableaddr += compressdata.size();
-			pImpl->m_totalcompresssize += compressdata.size();
-			pImpl->m_totalsize += datasize;
-		}
-		else if (t == PckPendingActionType::Delete)
-		{
-			auto p1 = (PckPendingItem_Delete*)p.get();
-			auto& item = GetSingleFileItem(p1->GetFileName());
-
-			pImpl->m_totalcompresssize -= item.GetCompressDataSize();
-			pImpl->m_totalsize -= item.GetDataSize();
-
-			auto iter = std::remove(pImpl->m_items.begin(), pImpl->m_items.end(), item);
-			pImpl->m_items.erase(iter);
-		}
-		else if (t == PckPendingActionType::Rename)
-		{
-			auto p1 = (PckPendingItem_Rename*)p.get();
-			auto& item = const_cast<PckItem&>(p1->GetItem());
-			memset(item.m_index.szFilename, 0, 256);
-			strcpy(item.m_index.szFilename, p1->GetNewFileName().c_str());
-		}
-		else if (t == PckPendingActionType::Update)
-		{
-			auto p1 = (PckPendingItem_Update*)p.get();
-			auto& compressdata = p1->GetCompressData();
-			auto& data = p1->GetData();
-			auto& item = const_cast<PckItem&>(p1->GetItem());
-
-			// 先在统计信息中减去旧数据的大小
-			pImpl->m_totalcompresssize -= item.GetCompressDataSize();
-			pImpl->m_totalsize -= item.GetDataSize();
-
-			if (compressdata.size() > item.GetCompressDataSize())
-			{
-				// 如果新数据量大于旧数据量，则在文件末尾追加新数据
-				pImpl->m_file.Seek(pImpl->m_indextableaddr);
-				pImpl->m_file.Write(compressdata.data(), compressdata.size());
-
-				item.m_index.dwAddressOffset = pImpl->m_indextableaddr;
-				item.m_index.dwFileCompressDataSize = compressdata.size();
-				item.m_index.dwFileDataSize = data.size();
-
-				pImpl->m_indextableaddr += compressdata.size();
-			}
-			else
-			{
-				// 如果新数据量小于等于旧数据量，则直接覆盖之前的，避免产生多余的冗余数据量
-				pImpl->m_file.Seek(item.m_index.dwAddressOffset);
-				pImpl->m_file.Write(compressdata.data(), compressdata.size());
-
-				item.m_index.dwFileCompressDataSize = compressdata.size();
-				item.m_index.dwFileDataSize = data.size();
-			}
-
-			// 更新统计信息
-			pImpl->m_totalcompresssize += item.GetCompressDataSize();
-			pImpl->m_totalsize += item.GetDataSize();
-		}
-		p->Release();
-	}
+	pImpl->CommitTransaction(callback, nullptr);
+}
 
-	// 写出顺序是重要的！
-	pImpl->CalcIndexTableAddr();
-	pImpl->WriteIndexTable();
-	pImpl->WriteHead();
-	pImpl->WriteTail();
-	
-	// 修正文件尺寸
-	pImpl->m_file.SetSize(pImpl->m_head.dwPckSize);
+void PckFile::CommitTransaction(ProcessCallback callback, const CompressPolicy& policy)
+{
+	pImpl->CommitTransaction(callback, &policy);
+}
 
-	pImpl->m_pendingitems.clear();
-	pImpl->m_trans = false;
+PckFile::CompressReport PckFile::GetCompressReport() const noexcept
+{
+	return pImpl->m_compressstats.Report();
 }
 
 void PckFile::AddItem(const void* buf, uint32_t len, const std::string& filename)
 {
-	auto s = NormalizePckFileName(filename);
-	try
-	{
-		UpdateItem(GetSingleFileItem(s), buf, len);
-	}
-	catch (...)
-	{
-		pImpl->AddPendingItem(std::make_unique<PckPendingItem_AddBuffer>(s, buf, len));
-	}
+	pImpl->AddBufferItem(buf, len, filename, nullptr);
+}
+
+void PckFile::AddItem(const void* buf, uint32_t len, const std::string& filename, const CompressPolicy& policy)
+{
+	pImpl->AddBufferItem(buf, len, filename, std::make_shared<const CompressPolicy>(policy));
 }
 
 void PckFile::AddItem(const PckItem& item)
 {
-	if (item.m_pck.lock().get() == this)
+	if (item.m_table == &pImpl->m_table)
 	{
 		// 如果传入的文件对象为当前pck文件中的，直接跳过
 		return;
@@ -470,19 +890,12 @@ void PckFile::AddItem(const PckItem& item)
 
 void PckFile::AddItem(const std::string& diskfilename, const std::string& pckfilename)
 {
-	if (MyGetFileSize(diskfilename.c_str()) > PCK_MAX_ITEM_SIZE)
-	{
-		throw new std::runtime_error("目标文件过大");
-	}
-	auto s = NormalizePckFileName(pckfilename);
-	try
-	{
-		UpdateItem(GetSingleFileItem(s), diskfilename);
-	}
-	catch (...)
-	{
-		pImpl->AddPendingItem(std::make_unique<PckPendingItem_AddFile>(s, diskfilename));
-	}
+	pImpl->AddFileItem(diskfilename, pckfilename, nullptr);
+}
+
+void PckFile::AddItem(const std::string& diskfilename, const std::string& pckfilename, const CompressPolicy& policy)
+{
+	pImpl->AddFileItem(diskfilename, pckfilename, std::make_shared<const CompressPolicy>(policy));
 }
 
 void PckFile::DeleteItem(const PckItem& item)
@@ -520,7 +933,8 @@ int PckFile::DeleteDirectory(const std::string& dirname)
 	int n = 0;
 	for (auto i = this->begin(); i != this->end(); ++i)
 	{
-		if (StringHelper::CompareIgnoreCase(std::string(i->GetFileName()).substr(0, dir.size()), dir) == 0)
+		std::string_view name = i->GetFileName();
+		if (name.size() >= dir.size() && PckNameIndex::EqualIgnoreCase(name.substr(0, dir.size()), dir))
 		{
 			pImpl->AddPendingItem(std::make_unique<PckPendingItem_Delete>(*i));
 			++n;
@@ -529,41 +943,256 @@ int PckFile::DeleteDirectory(const std::string& dirname)
 	return n;
 }
 
-void PckFile::CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname, bool overwrite, ProcessCallback callback)
+int PckFile::RenameDirectory(const std::string& dirname, const std::string& newname)
 {
-	auto pck = PckFile::Create(filename, overwrite);
-	auto basedir = filesystem::absolute(dir + "/");
-	filesystem::path rootname = usedirname ? basedir.parent_path().filename() : "";
-	pck->BeginTransaction();
-	PckFileImpl::EnumDir(basedir, rootname, [&](std::string diskpath, std::string pckpath) {
-		pck->AddItem(diskpath, pckpath);
-	});
-	pck->CommitTransaction(callback);
-}
+	auto olddir = NormalizePckFileName(dirname);
+	auto newdir = NormalizePckFileName(newname);
+	if (olddir.empty())
+	{
+		throw std::runtime_error("目录名不能为空");
+	}
+	olddir.append("\\");
+	if (!newdir.empty())
+	{
+		newdir.append("\\");
+	}
+	auto inold = [&](std::string_view name) {
+		return name.size() >= olddir.size() && PckNameIndex::EqualIgnoreCase(name.substr(0, olddir.size()), olddir);
+	};
+
+	// 先计算全部新文件名并检查冲突，有冲突时不做任何修改
+	// 与目录下其他文件同名不算冲突，因为那个文件也会被移走
+	std::vector<std::pair<uint32_t, std::string>> renames;
+	for (auto i = this->begin(); i != this->end(); ++i)
+	{
+		std::string_view name = i->GetFileName();
+		if (!inold(name))
+		{
+			continue;
+		}
+		std::string s = newdir;
+		s.append(name.substr(olddir.size()));
+		if (s.size() >= MAX_PATH_PCK)
+		{
+			throw std::runtime_error("文件名长度超出限制");
+		}
+		auto index = pImpl->FindItem(s);
+		if (index != PckNameIndex::npos && !inold(pImpl->ItemName(index)))
+		{
+			throw std::runtime_error("存在同名文件");
+		}
+		renames.emplace_back(i->m_index, std::move(s));
+	}
+	if (renames.empty())
+	{
+		return 0;
+	}
+
+	// 全部重命名在同一个事务中提交，只写一次索引表
+	auto trans = pImpl->m_trans;
+	if (!trans)
+	{
+		BeginTransaction();
+	}
+	for (auto& r : renames)
+	{
+		pImpl->m_pendingitems.emplace_back(std::make_unique<PckPendingItem_Rename>(pImpl->m_items[r.first], r.second));
+	}
+	if (!trans)
+	{
+		CommitTransaction();
+	}
+	return (int)renames.size();
+}
+
+void PckFile::CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname, bool overwrite, ProcessCallback callback)
+{
+	PckFileImpl::CreateFromDirectory(filename, dir, usedirname, overwrite, callback, nullptr);
+}
+
+PckFile::CompressReport PckFile::CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname, bool overwrite, ProcessCallback callback, const CompressPolicy& policy)
+{
+	return PckFileImpl::CreateFromDirectory(filename, dir, usedirname, overwrite, callback, &policy);
+}
 
 void PckFile::ReBuild(const std::string& filename, const std::string& newname, bool overwrite, ProcessCallback callback)
 {
 	auto pck = PckFile::Open(filename);
-	auto pcknew = PckFile::Create(newname, overwrite);
+	auto& src = *pck->pImpl;
+	auto order = src.UniqueItems();
+	std::sort(order.begin(), order.end(), [&](uint32_t left, uint32_t right) {
+		return PckNameIndex::LessIgnoreCase(src.ItemName(left), src.ItemName(right));
+	});
+	PckFileImpl::RebuildTo(src, order, newname, overwrite, callback);
+}
 
-	// 去重
+void PckFile::ReBuildWithTrace(const std::string& filename, const std::string& newname, const std::string& tracefile, bool overwrite, ProcessCallback callback)
+{
+	auto trace = PckAccessTrace::Load(tracefile);
+	auto pck = PckFile::Open(filename);
+	auto& src = *pck->pImpl;
+	auto items = src.UniqueItems();
+
+	// 先按记录的顺序排列读取过的文件
+	std::vector<uint8_t> placed(src.m_items.size());
+	std::vector<uint32_t> order;
+	order.reserve(items.size());
+	for (auto& name : trace)
 	{
-		auto& items = pck->pImpl->m_items;
-		std::sort(items.begin(), items.end(), [](const PckItem& left, const PckItem& right) {
-			return StringHelper::CompareIgnoreCase(std::string(left.GetFileName()), std::string(right.GetFileName())) < 0;
-		});
-		auto it = std::unique(items.begin(), items.end(), [](const PckItem& left, const PckItem& right) {
-			return StringHelper::CompareIgnoreCase(std::string(left.GetFileName()), std::string(right.GetFileName())) == 0;
-		});
-		items.erase(it, items.end());
+		auto i = src.FindItem(NormalizePckFileName(name));
+		if (i != PckNameIndex::npos && !placed[i])
+		{
+			placed[i] = 1;
+			order.push_back(i);
+		}
+	}
+
+	// 其余的文件按目录分组，同一目录下的文件相邻，目录和文件名都按字母顺序
+	auto rest = order.size();
+	for (auto i : items)
+	{
+		if (!placed[i])
+		{
+			order.push_back(i);
+		}
+	}
+	auto split = [&](uint32_t i) {
+		auto name = src.ItemName(i);
+		auto pos = name.rfind('\\');
+		return pos == std::string_view::npos
+			? std::make_pair(std::string_view(), name)
+			: std::make_pair(name.substr(0, pos), name.substr(pos + 1));
+	};
+	std::sort(order.begin() + rest, order.end(), [&](uint32_t left, uint32_t right) {
+		auto l = split(left), r = split(right);
+		if (!PckNameIndex::EqualIgnoreCase(l.first, r.first))
+		{
+			return PckNameIndex::LessIgnoreCase(l.first, r.first);
+		}
+		return PckNameIndex::LessIgnoreCase(l.second, r.second);
+	});
+
+	PckFileImpl::RebuildTo(src, order, newname, overwrite, callback);
+}
+
+void PckFile::StartAccessTrace()
+{
+	pImpl->m_trace.Start();
+}
+
+void PckFile::StopAccessTrace() noexcept
+{
+	pImpl->m_trace.Stop();
+}
+
+void PckFile::SaveAccessTrace(const std::string& filename) const
+{
+	pImpl->m_trace.Save(filename);
+}
+
+uint64_t PckFile::Compact(ProcessCallback callback)
+{
+	if (pImpl->m_trans)
+	{
+		throw std::runtime_error("事务中不能整理文件");
+	}
+	pImpl->DecodeAllItems();
+	pImpl->EnsureIndexRecords();
+	auto oldsize = pImpl->m_head.dwPckSize;
+	auto& table = pImpl->m_table;
+	// 整理前的数据区末尾，文件中的索引指向的数据都在这之前，中途写入的索引表放在这之后
+	auto dataend = pImpl->DataEnd();
+
+	// 中途把索引写入文件，写到不覆盖文件中当前索引表的位置，写入文件头之后才生效
+	auto persist = [&]() {
+		pImpl->EncodeIndexTable();
+		pImpl->SwitchIndexTable(pImpl->IndexTableOverlaps(dataend) ? pImpl->m_head.dwPckSize : dataend);
+	};
+
+	// 按数据位置排序
+	auto count = (uint32_t)table.Size();
+	std::vector<uint32_t> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return table.Offset(a) < table.Offset(b); });
+
+	std::vector<uint8_t> buf;
+	uint64_t pos = sizeof(_PckHead);
+	bool moved = false;
+	// 上次写入索引之后移走的数据原来的最低位置，文件中的索引仍然指向那里，不能覆盖
+	uint64_t unsaved = UINT64_MAX;
+	uint64_t batch = 0;
+	for (uint32_t i = 0; i < count;)
+	{
+		if (callback && !callback(i, count))
+		{
+			break;
+		}
+		// 从第i项开始取出一段连续的数据，互相重叠的文件必须在同一段中，整段一起移动
+		auto start = table.Offset(order[i]);
+		auto end = start + table.CompressDataSize(order[i]);
+		auto j = i + 1;
+		for (; j < count; ++j)
+		{
+			auto offset = table.Offset(order[j]);
+			if (offset > end || (offset == end && end - start >= PckFileImpl::CompactChunkSize))
+			{
+				break;
+			}
+			end = std::max(end, offset + table.CompressDataSize(order[j]));
+		}
+		if (start > pos)
+		{
+			// 目标位置与之前移走的文件原来的位置重叠，或者已经移动了足够多的数据时，先把索引写入文件
+			// 这样中断时只有正在移动的这一段数据（目标与自身原来的位置重叠时）可能损坏
+			if (pos + (end - start) > unsaved || batch >= PckFileImpl::CompactBatchSize)
+			{
+				persist();
+				unsaved = UINT64_MAX;
+				batch = 0;
+			}
+			pImpl->MoveData(start, pos, end - start, buf);
+			for (auto k = i; k < j; ++k)
+			{
+				auto index = order[k];
+				table.SetLocation(index, pos + (table.Offset(index) - start), table.DataSize(index), table.CompressDataSize(index));
+			}
+			moved = true;
+			unsaved = std::min(unsaved, start);
+			batch += end - start;
+			pos += end - start;
+		}
+		else
+		{
+			pos = std::max(pos, end);
+		}
+		i = j;
+	}
+
+	// 数据位置改变后，缓存和去重表中以位置为键的数据都失效了
+	if (moved && pImpl->m_datacache)
+	{
+		pImpl->m_datacache->Clear();
+	}
+	if (moved)
+	{
+		pImpl->m_dedup.Clear();
 	}
 
-	pcknew->BeginTransaction();
-	for (auto& i : pck->pImpl->m_items)
+	// 把索引表移到新的数据区末尾，会覆盖文件中当前的索引表时先写到文件末尾，再移回来
+	auto newend = pImpl->DataEnd();
+	if (moved || newend != pImpl->m_indextableaddr)
 	{
-		pcknew->AddItem(i);
+		pImpl->EncodeIndexTable();
+		if (pImpl->IndexTableOverlaps(newend))
+		{
+			pImpl->SwitchIndexTable(pImpl->m_head.dwPckSize);
+		}
+		pImpl->SwitchIndexTable(newend);
 	}
-	pcknew->CommitTransaction(callback);
+	pImpl->m_freespace.Build(table.Offsets(), table.CompressDataSizes(), sizeof(_PckHead), pImpl->m_indextableaddr);
+
+	auto newsize = pImpl->m_head.dwPckSize;
+	return oldsize > newsize ? oldsize - newsize : 0;
 }
 
 //************************
@@ -572,7 +1201,8 @@ void PckFile::ReBuild(const std::string& filename, const std::string& newname, b
 #pragma region PckFileImpl
 
 PckFile::PckFileImpl::PckFileImpl(PckFile* pck) : 
-	m_pck(pck)
+	m_pck(pck),
+	m_table(pck)
 {
 }
 
@@ -600,52 +1230,252 @@ void PckFile::PckFileImpl::ReadTail()
 	}
 }
 
-void PckFile::PckFileImpl::ReadIndexTable()
+void PckFile::PckFileImpl::ReadIndexTable(bool lazy)
 {
 	m_indextableaddr = m_tail.dwIndexValue ^ PCK_ADDR_MASK;
+	auto tailaddr = m_head.dwPckSize - sizeof(_PckTail);
+	if (m_indextableaddr < sizeof(_PckHead) || m_indextableaddr > tailaddr || tailaddr - m_indextableaddr > UINT32_MAX)
+	{
+		throw std::runtime_error("文件索引表地址错误");
+	}
+
+	// 一次性读取整个索引表
+	std::vector<uint8_t> buf(tailaddr - m_indextableaddr);
 	m_file.Seek(m_indextableaddr);
-	m_items.resize(m_tail.dwFileCount);
-	auto pthis = m_pck->shared_from_this();
-	m_indextablesize = 0;
-	for (size_t i = 0; i < m_tail.dwFileCount; i++)
+	m_file.Read(buf.data(), buf.size());
+
+	// 扫描每条索引的长度前缀，确定每条索引的位置
+	auto count = m_tail.dwFileCount;
+	std::vector<uint32_t> offsets(count);
+	size_t pos = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		offsets[i] = pos;
+		pos += ScanIndex(buf.data() + pos, buf.size() - pos);
+	}
+	m_indextablesize = pos;
+
+	ResetItems(count);
+	if (lazy)
+	{
+		// 保留原始数据，在访问时再解压
+		m_lazybuf.swap(buf);
+		m_lazyoffsets.swap(offsets);
+		m_decoded = std::make_unique<std::atomic<bool>[]>(count);
+		m_lazynamed = 0;
+		m_nameindex.Clear();
+		m_nameindex.Reserve(count);
+		m_lazyinflater = std::make_unique<PckInflater>();
+		m_lazy = count > 0;
+		return;
+	}
+
+	// 多线程解压索引
+	std::atomic<uint64_t> totalsize(0), totalcompresssize(0);
+	ParallelFor(count, 4096, [&](size_t begin, size_t end) {
+		PckInflater inflater;
+		_PckItemIndex index;
+		uint64_t size = 0, compresssize = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			auto p = buf.data() + offsets[i];
+			DecodeIndex(inflater, p + 8, ScanIndex(p, buf.size() - offsets[i]) - 8, &index);
+			m_table.Set(i, index);
+			size += index.dwFileDataSize;
+			compresssize += index.dwFileCompressDataSize;
+		}
+		totalsize += size;
+		totalcompresssize += compresssize;
+	});
+	m_totalsize = totalsize;
+	m_totalcompresssize = totalcompresssize;
+	BuildNameIndex();
+	// 可写时保留原始数据，提交时未修改的索引直接复制，不需要重新压缩
+	if (!m_file.IsReadOnly())
+	{
+		buf.resize(pos);
+		m_table.SetRecords(std::move(buf), std::move(offsets));
+	}
+}
+
+// 延迟解压模式下，确保指定的索引已解压，可以多线程同时调用
+void PckFile::PckFileImpl::DecodeItem(size_t i)
+{
+	if (!m_lazy || i >= m_items.size() || m_decoded[i].load(std::memory_order_acquire))
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_lazymutex);
+	if (!m_lazy || m_decoded[i])
+	{
+		return;
+	}
+	DecodeLazyItem(i, *m_lazyinflater);
+}
+
+// 从m_lazybuf中解压一条索引，调用者负责同步
+void PckFile::PckFileImpl::DecodeLazyItem(size_t i, PckInflater& inflater)
+{
+	_PckItemIndex index;
+	auto p = m_lazybuf.data() + m_lazyoffsets[i];
+	DecodeIndex(inflater, p + 8, ScanIndex(p, m_lazybuf.size() - m_lazyoffsets[i]) - 8, &index);
+	m_table.Set(i, index);
+	m_decoded[i].store(true, std::memory_order_release);
+}
+
+// 延迟解压模式下，多线程解压剩余的全部索引，之后退出延迟解压模式
+void PckFile::PckFileImpl::DecodeAllItems()
+{
+	if (!m_lazy)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_lazymutex);
+	if (!m_lazy)
+	{
+		return;
+	}
+	ParallelFor(m_items.size(), 4096, [&](size_t begin, size_t end) {
+		PckInflater inflater;
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (!m_decoded[i])
+			{
+				DecodeLazyItem(i, inflater);
+			}
+		}
+	});
+	FinishLazyDecode();
+}
+
+// 全部索引都已解压，计算统计信息并释放原始数据，必须在持有m_lazymutex时调用
+// m_decoded不释放，因为其他线程可能正在无锁读取它
+void PckFile::PckFileImpl::FinishLazyDecode()
+{
+	m_totalsize = 0;
+	m_totalcompresssize = 0;
+	for (auto size : m_table.DataSizes())
 	{
-		m_items[i].m_pck = pthis;
-		m_indextablesize += ReadIndex(&m_items[i].m_index);
-		m_totalsize += m_items[i].m_index.dwFileDataSize;
-		m_totalcompresssize += m_items[i].m_index.dwFileCompressDataSize;
+		m_totalsize += size;
 	}
+	for (auto size : m_table.CompressDataSizes())
+	{
+		m_totalcompresssize += size;
+	}
+	if (m_lazynamed < m_items.size())
+	{
+		BuildNameIndex();
+	}
+	if (!m_file.IsReadOnly() && !m_table.HasRecords())
+	{
+		// 全部索引都没有修改过，原始数据转为索引记录缓存
+		m_lazybuf.resize(m_indextablesize);
+		m_table.SetRecords(std::move(m_lazybuf), std::move(m_lazyoffsets));
+	}
+	std::vector<uint8_t>().swap(m_lazybuf);
+	std::vector<uint32_t>().swap(m_lazyoffsets);
+	m_lazyinflater.reset();
+	m_lazy = false;
 }
 
-uint32_t PckFile::PckFileImpl::ReadIndex(_PckItemIndex* pindex)
+// 检查一条索引的长度前缀，返回整条索引（包括8字节前缀）的长度
+uint32_t PckFile::PckFileImpl::ScanIndex(const uint8_t* p, size_t avail)
 {
-	uint32_t check1, check2, len1, len2;
-	m_file.Read(&check1, 4);
-	m_file.Read(&check2, 4);
-	len1 = check1 ^ PCK_INDEX_MASK1;
-	len2 = check2 ^ PCK_INDEX_MASK2;
-	if (len1 != len2)
+	if (avail < 8)
+	{
+		throw std::runtime_error("文件索引的长度错误");
+	}
+	uint32_t len1, len2;
+	memcpy(&len1, p, 4);
+	memcpy(&len2, p + 4, 4);
+	len1 ^= PCK_INDEX_MASK1;
+	len2 ^= PCK_INDEX_MASK2;
+	if (len1 != len2 || len1 > avail - 8)
 	{
 		throw std::runtime_error("文件索引的长度错误");
 	}
-	std::vector<char> buf(len1);
-	m_file.Read(buf.data(), len1);
-	uLongf destLen = sizeof(_PckItemIndex);
-	auto ret = uncompress((Bytef*)pindex, &destLen, (Bytef*)buf.data(), len1);
-	if (ret != Z_OK)
+	return len1 + 8;
+}
+
+void PckFile::PckFileImpl::DecodeIndex(PckInflater& inflater, const uint8_t* p, uint32_t len, _PckItemIndex* pindex)
+{
+	uint32_t destlen = sizeof(_PckItemIndex);
+	if (!inflater.Inflate(pindex, destlen, p, len))
 	{
-		if (len1 != sizeof(_PckItemIndex))
+		if (len != sizeof(_PckItemIndex))
 		{
 			throw std::runtime_error("解压文件索引失败");
 		}
 		else
 		{
-			memcpy(pindex, buf.data(), len1);
+			memcpy(pindex, p, len);
 		}
 	}
-	auto s = NormalizePckFileName(pindex->szFilename);
-	memset(pindex->szFilename, 0, 256);
-	strcpy(pindex->szFilename, s.c_str());
-	return len1 + 8;
+	NormalizePckFileNameInPlace(pindex->szFilename);
+}
+
+// 解压文件数据，解压失败且数据大小相同时，认为数据未压缩
+void PckFile::PckFileImpl::DecodeData(const uint8_t* src, uint32_t srclen, uint8_t* dest, uint32_t destlen)
+{
+	// 每个线程复用同一个解压器，避免每次都重新分配解压状态
+	thread_local PckInflater inflater;
+	auto len = destlen;
+	if (!inflater.Inflate(dest, len, src, srclen))
+	{
+		if (srclen != destlen)
+		{
+			throw std::runtime_error("解压数据失败");
+		}
+		else
+		{
+			memcpy(dest, src, srclen);
+		}
+	}
+}
+
+// 读取并解压文件数据，dest的大小必须等于解压后的数据大小
+void PckFile::PckFileImpl::ReadItemData(const PckItem& item, uint8_t* dest)
+{
+	auto datasize = item.GetDataSize();
+	auto compresssize = item.GetCompressDataSize();
+	if (m_file.IsMapped())
+	{
+		// 直接从映射的内存中解压
+		auto view = m_pck->GetSingleFileCompressView(item);
+		DecodeData(view.data(), view.size(), dest, datasize);
+	}
+	else if (compresssize <= MaxScratchSize)
+	{
+		thread_local std::vector<uint8_t> scratch;
+		if (scratch.size() < compresssize)
+		{
+			scratch.resize(compresssize);
+		}
+		m_pck->GetSingleFileCompressData(item, std::span<uint8_t>(scratch));
+		DecodeData(scratch.data(), compresssize, dest, datasize);
+	}
+	else
+	{
+		auto compressdata = m_pck->GetSingleFileCompressData(item);
+		DecodeData(compressdata.data(), compresssize, dest, datasize);
+	}
+}
+
+void PckFile::PckFileImpl::StartAsync()
+{
+	std::call_once(m_asyncflag, [this] {
+		m_inflatepool = std::make_unique<PckThreadPool>();
+		m_asyncio = std::make_unique<PckAsyncIO>();
+	});
+}
+
+// 从数据缓存中移除第index项的数据，在修改或删除之前调用
+void PckFile::PckFileImpl::InvalidateItemData(uint32_t index)
+{
+	if (m_datacache)
+	{
+		m_datacache->Erase(m_table.Offset(index), m_table.CompressDataSize(index));
+	}
 }
 
 void PckFile::PckFileImpl::WriteHead()
@@ -663,78 +1493,1041 @@ void PckFile::PckFileImpl::WriteTail()
 	m_file.Write(&m_tail, sizeof(_PckTail));
 }
 
-void PckFile::PckFileImpl::WriteIndexTable()
+// 写入索引表，oldaddr为本次提交之前索引表的位置
+// 第一个变化的项之前的记录不需要重新压缩：索引表没有移动时它们在文件中原样保留，只写入后面的部分；
+// 索引表移动时（追加了数据）把它们一次性整体复制到新的位置
+void PckFile::PckFileImpl::WriteIndexTable(uint64_t oldaddr)
 {
-	m_file.Seek(m_indextableaddr);
-	m_indextablesize = 0;
-	for (auto& i : m_items)
+	auto first = EncodeIndexTable();
+	auto size = m_table.RecordsSize(m_table.Size());
+	auto begin = m_indextableaddr == oldaddr ? m_table.RecordsSize(first) : 0;
+	if (size > begin)
+	{
+		m_file.Seek(m_indextableaddr + begin);
+		m_file.Write(m_table.Record(0).data() + begin, size - begin);
+	}
+	m_indextablesize = size;
+}
+
+// 压缩修改过的索引，与未修改的记录一起更新索引记录缓存，之后缓存与完整的索引表一致
+// 返回第一个修改过的项的序号，之前的记录没有变化
+size_t PckFile::PckFileImpl::EncodeIndexTable()
+{
+	auto count = m_table.Size();
+	auto first = m_table.FirstChangedRecord();
+
+	// 多线程压缩修改过的索引，每条写入固定大小的槽中
+	std::vector<uint32_t> dirty;
+	for (size_t i = first; i < count; ++i)
+	{
+		if (m_table.Record(i).empty())
+			dirty.push_back(i);
+	}
+	const size_t slotsize = compressBound(sizeof(_PckItemIndex)) + 8;
+	std::vector<uint8_t> slots(dirty.size() * slotsize);
+	std::vector<uint32_t> slotlens(dirty.size());
+	ParallelFor(dirty.size(), 1024, [&](size_t begin, size_t end) {
+		_PckItemIndex index;
+		for (size_t j = begin; j < end; ++j)
+		{
+			m_table.Get(dirty[j], index);
+			slotlens[j] = EncodeIndex(index, slots.data() + j * slotsize);
+		}
+	});
+
+	// 按顺序拼接未修改的记录和新压缩的记录
+	std::vector<uint8_t> buf;
+	std::vector<uint32_t> offsets;
+	offsets.reserve(count - first);
+	size_t d = 0;
+	for (size_t i = first; i < count; ++i)
 	{
-		m_indextablesize += WriteIndex(i.m_index);
+		offsets.push_back(buf.size());
+		if (d < dirty.size() && dirty[d] == i)
+		{
+			auto p = slots.data() + d * slotsize;
+			buf.insert(buf.end(), p, p + slotlens[d]);
+			++d;
+		}
+		else
+		{
+			auto record = m_table.Record(i);
+			buf.insert(buf.end(), record.begin(), record.end());
+		}
 	}
+
+	m_table.CommitRecords(first, buf, offsets);
+	return first;
 }
 
-uint32_t PckFile::PckFileImpl::WriteIndex(const _PckItemIndex& index)
+// 压缩一条索引，把包括长度前缀的完整记录写入out，out至少要有compressBound(sizeof(index)) + 8字节，返回记录长度
+uint32_t PckFile::PckFileImpl::EncodeIndex(const _PckItemIndex& index, uint8_t* out)
 {
-	auto len = compressBound(sizeof(index));
-	std::vector<uint8_t> buf(len);
-	auto ret = compress2(buf.data(), &len, (const Bytef*)&index, sizeof(index), Z_DEFAULT_COMPRESSION);
-	if (ret != Z_OK)
+	// 每个线程复用同一个压缩器，索引很小，重新分配压缩状态的开销远大于压缩本身
+	thread_local PckDeflater deflater;
+	uint32_t len = compressBound(sizeof(index));
+	if (!deflater.Deflate(out + 8, len, &index, sizeof(index)))
 	{
 		throw std::runtime_error("压缩数据失败");
 	}
-	buf.resize(len);
 	uint32_t len1 = len ^ PCK_INDEX_MASK1;
 	uint32_t len2 = len ^ PCK_INDEX_MASK2;
-	m_file.Write(&len1, 4);
-	m_file.Write(&len2, 4);
-	m_file.Write(buf.data(), len);
+	memcpy(out, &len1, 4);
+	memcpy(out + 4, &len2, 4);
 	return len + 8;
 }
 
-void PckFile::PckFileImpl::AddPendingItem(std::unique_ptr<PckPendingItem>&& item)
+// 确保索引记录缓存与索引表一致，打开时没有保留原始数据（例如从索引缓存文件加载）时，从文件中一次性读取当前的索引表
+void PckFile::PckFileImpl::EnsureIndexRecords()
 {
-	auto trans = m_trans;
-	if (!trans)
+	if (m_table.HasRecords())
 	{
-		m_pck->BeginTransaction();
+		return;
 	}
-	m_pendingitems.emplace_back(std::move(item));
-	if (!trans)
+	std::vector<uint8_t> buf(m_indextablesize);
+	if (!buf.empty())
 	{
-		m_pck->CommitTransaction();
+		m_file.Seek(m_indextableaddr);
+		m_file.Read(buf.data(), buf.size());
+	}
+	std::vector<uint32_t> offsets(m_table.Size());
+	size_t pos = 0;
+	for (size_t i = 0; i < offsets.size(); ++i)
+	{
+		offsets[i] = pos;
+		pos += ScanIndex(buf.data() + pos, buf.size() - pos);
 	}
+	m_table.SetRecords(std::move(buf), std::move(offsets));
 }
 
-void PckFile::PckFileImpl::EnumDir(filesystem::path dir, filesystem::path base, std::function<void(std::string, std::string)> callback)
+void PckFile::PckFileImpl::CommitTransaction(ProcessCallback callback, const CompressPolicy* policy)
 {
-	filesystem::directory_iterator dir_end;
-	for (auto i = filesystem::directory_iterator(dir); i != dir_end; ++i)
+	m_compressstats.Clear();
+	if (!m_trans)
 	{
-		auto status = i->status();
-		if (filesystem::is_regular_file(status))
-		{
-			auto diskpath = StringHelper::T2A(i->path().c_str());
-			auto pckpath = StringHelper::T2A((base / i->path().filename()).c_str());
-			callback(diskpath, pckpath);
-		}
-		else if (filesystem::is_directory(status))
-		{
-			EnumDir(*i, base / i->path().filename(), callback);
-		}
+		m_pendingitems.clear();
+		return;
 	}
-}
 
-// 计算索引表（即数据区末尾）的偏移
-// 在删除数据末尾的文件时，可以回收这些空间
-void PckFile::PckFileImpl::CalcIndexTableAddr()
-{
-	for (auto& item : m_items)
+	// 写入前必须解压全部索引，并在追加数据覆盖旧索引表之前保存其原始数据
+	DecodeAllItems();
+	EnsureIndexRecords();
+	m_deletemarks.clear();
+	m_deletecount = 0;
+	auto oldaddr = m_indextableaddr;
+	if (!m_freespace.IsBuilt())
 	{
-		auto addr = item.m_index.dwAddressOffset + item.m_index.dwFileCompressDataSize;
-		if (addr > m_indextableaddr)
-		{
-			m_indextableaddr = addr;
-		}
+		m_freespace.Build(m_table.Offsets(), m_table.CompressDataSizes(), sizeof(_PckHead), m_indextableaddr);
+	}
+
+	// 在工作线程中按顺序预先读取和压缩数据，当前线程按原来的顺序写入，保证文件布局不变
+	auto total = m_pendingitems.size();
+	for (auto& p : m_pendingitems)
+	{
+		p->SetCommitContext(policy, &m_compressstats, &m_dedup);
 	}
+	m_dedup.ResetClaims();
+	HashExistingData();
+	OrderedPrefetcher prefetcher(total, PckFileImpl::CommitWindowSize, [this](size_t i) {
+		return m_pendingitems[i]->Prepare();
+	});
+	try
+	{
+		for (size_t i = 0; i < total; ++i)
+		{
+			auto& p = m_pendingitems[i];
+			if (callback && !callback(i, total))
+			{
+				throw std::runtime_error("用户手动取消");
+			}
+			prefetcher.Wait(i);
+			auto t = p->GetType();
+			if (t == PckPendingActionType::Add)
+			{
+				auto p1 = (PckPendingItem_Add*)p.get();
+				auto datasize = p1->GetDataSize();
+				PckDedupTable::Blob blob;
+				if (p1->IsDedup() && FindSharedData(p1, p1->GetData(), blob))
+				{
+					// 与已写入的数据相同，直接共享，不压缩也不写入
+					m_freespace.AddRef(blob.offset);
+					AppendItem(p1->GetFileName(), blob.offset, datasize, blob.compresssize);
+					p1->CountDeduped(datasize);
+
+					m_totalcompresssize += blob.compresssize;
+					m_totalsize += datasize;
+				}
+				else
+				{
+					auto& compressdata = p1->GetCompressData();
+					auto offset = AllocateData(compressdata.size());
+					m_file.Seek(offset);
+					m_file.Write(compressdata.data(), compressdata.size());
+
+					AppendItem(p1->GetFileName(), offset, datasize, compressdata.size());
+					p1->CountWritten(datasize, compressdata.size());
+					uint64_t hash;
+					if (p1->GetContentHash(hash))
+					{
+						m_dedup.Insert(hash, datasize, { offset, (uint32_t)compressdata.size() });
+					}
+
+					m_totalcompresssize += compressdata.size();
+					m_totalsize += datasize;
+				}
+			}
+			else if (t == PckPendingActionType::Delete)
+			{
+				auto p1 = (PckPendingItem_Delete*)p.get();
+				auto index = FindItem(p1->GetFileName());
+				if (index == PckNameIndex::npos)
+				{
+					throw std::runtime_error("找不到指定的文件");
+				}
+
+				InvalidateItemData(index);
+				FreeData(m_table.Offset(index), m_table.CompressDataSize(index));
+				MarkItemDeleted(index);
+			}
+			else if (t == PckPendingActionType::Rename)
+			{
+				auto p1 = (PckPendingItem_Rename*)p.get();
+				auto index = p1->GetIndex();
+				if (IsItemDeleted(index))
+				{
+					throw std::runtime_error("找不到指定的文件");
+				}
+				m_nameindex.Erase(index, [this](uint32_t i) { return ItemName(i); });
+				m_table.SetName(index, p1->GetNewFileName());
+				if (m_nameindex.HasDuplicate())
+				{
+					BuildNameIndex();
+				}
+				else
+				{
+					m_nameindex.Insert(index, [this](uint32_t i) { return ItemName(i); });
+				}
+			}
+			else if (t == PckPendingActionType::Update)
+			{
+				auto p1 = (PckPendingItem_Update*)p.get();
+				auto& data = p1->GetData();
+				auto index = p1->GetIndex();
+				auto& table = m_table;
+				if (IsItemDeleted(index))
+				{
+					throw std::runtime_error("找不到指定的文件");
+				}
+
+				// 先在统计信息中减去旧数据的大小
+				InvalidateItemData(index);
+				m_totalcompresssize -= table.CompressDataSize(index);
+				m_totalsize -= table.DataSize(index);
+
+				auto oldoffset = table.Offset(index);
+				auto oldsize = table.CompressDataSize(index);
+				PckDedupTable::Blob blob;
+				if (FindSharedData(p1, data, blob))
+				{
+					// 与已写入的数据相同，释放旧数据后共享，新内容与旧内容相同时什么也不用做
+					if (blob.offset != oldoffset)
+					{
+						FreeData(oldoffset, oldsize);
+						m_freespace.AddRef(blob.offset);
+					}
+					table.SetLocation(index, blob.offset, data.size(), blob.compresssize);
+					p1->CountDeduped(data.size());
+				}
+				else
+				{
+					auto& compressdata = p1->GetCompressData();
+					uint64_t offset;
+					if (compressdata.size() > oldsize || m_freespace.IsShared(oldoffset))
+					{
+						// 如果新数据量大于旧数据量，或者旧数据还被其他文件共享，则释放旧数据的空间，在空洞或文件末尾写入新数据
+						// 先释放再分配，旧数据与相邻的空洞合并后可能正好容纳新数据
+						FreeData(oldoffset, oldsize);
+						offset = AllocateData(compressdata.size());
+						m_file.Seek(offset);
+						m_file.Write(compressdata.data(), compressdata.size());
+					}
+					else
+					{
+						// 如果新数据量小于等于旧数据量，则直接覆盖之前的，剩余的部分作为空洞
+						m_dedup.Erase(oldoffset);
+						offset = oldoffset;
+						m_file.Seek(oldoffset);
+						m_file.Write(compressdata.data(), compressdata.size());
+						FreeData(oldoffset + compressdata.size(), oldsize - compressdata.size());
+					}
+					table.SetLocation(index, offset, data.size(), compressdata.size());
+					p1->CountWritten(data.size(), compressdata.size());
+					uint64_t hash;
+					if (p1->GetContentHash(hash))
+					{
+						m_dedup.Insert(hash, data.size(), { offset, (uint32_t)compressdata.size() });
+					}
+				}
+
+				// 更新统计信息
+				m_totalcompresssize += table.CompressDataSize(index);
+				m_totalsize += table.DataSize(index);
+			}
+			p->Release();
+			prefetcher.Release(i);
+		}
+	}
+	catch (...)
+	{
+		// 中途失败（包括用户取消）时，已经处理的删除操作同样生效：这些项的空间已经释放并可能被之后的文件使用，
+		// 必须从索引表中移除，否则下一次提交会把它们连同被覆盖的数据一起写入索引
+		SweepDeletedItems();
+		throw;
+	}
+
+	SweepDeletedItems();
+
+	// 写出顺序是重要的！
+	CalcIndexTableAddr();
+	WriteIndexTable(oldaddr);
+	WriteHead();
+	WriteTail();
+	
+	// 修正文件尺寸
+	m_file.SetSize(m_head.dwPckSize);
+
+	m_pendingitems.clear();
+	m_trans = false;
+}
+
+void PckFile::PckFileImpl::AddBufferItem(const void* buf, uint32_t len, const std::string& filename, std::shared_ptr<const CompressPolicy> policy)
+{
+	auto s = NormalizePckFileName(filename);
+	auto i = FindItem(s);
+	if (i != PckNameIndex::npos)
+	{
+		AddPendingItem(std::make_unique<PckPendingItem_UpdateBuffer>(m_items[i], buf, len, std::move(policy)));
+	}
+	else
+	{
+		AddPendingItem(std::make_unique<PckPendingItem_AddBuffer>(s, buf, len, std::move(policy)));
+	}
+}
+
+void PckFile::PckFileImpl::AddFileItem(const std::string& diskfilename, const std::string& pckfilename, std::shared_ptr<const CompressPolicy> policy)
+{
+	if (MyGetFileSize(diskfilename.c_str()) > PCK_MAX_ITEM_SIZE)
+	{
+		throw new std::runtime_error("目标文件过大");
+	}
+	auto s = NormalizePckFileName(pckfilename);
+	auto i = FindItem(s);
+	if (i != PckNameIndex::npos)
+	{
+		AddPendingItem(std::make_unique<PckPendingItem_UpdateFile>(m_items[i], diskfilename, std::move(policy)));
+	}
+	else
+	{
+		AddPendingItem(std::make_unique<PckPendingItem_AddFile>(s, diskfilename, std::move(policy)));
+	}
+}
+
+PckFile::CompressReport PckFile::PckFileImpl::CreateFromDirectory(const std::string& filename, const std::string& dir, bool usedirname, bool overwrite, ProcessCallback callback, const CompressPolicy* policy)
+{
+	auto pck = PckFile::Create(filename, overwrite);
+	auto basedir = filesystem::absolute(dir + "/");
+	filesystem::path rootname = usedirname ? basedir.parent_path().filename() : "";
+	pck->BeginTransaction();
+	EnumDir(basedir, rootname, [&](std::string diskpath, std::string pckpath) {
+		pck->AddItem(diskpath, pckpath);
+	});
+	pck->pImpl->CommitTransaction(callback, policy);
+	return pck->GetCompressReport();
+}
+
+void PckFile::PckFileImpl::AddPendingItem(std::unique_ptr<PckPendingItem>&& item)
+{
+	auto trans = m_trans;
+	if (!trans)
+	{
+		m_pck->BeginTransaction();
+	}
+	m_pendingitems.emplace_back(std::move(item));
+	if (!trans)
+	{
+		m_pck->CommitTransaction();
+	}
+}
+
+void PckFile::PckFileImpl::EnumDir(filesystem::path dir, filesystem::path base, std::function<void(std::string, std::string)> callback)
+{
+	filesystem::directory_iterator dir_end;
+	for (auto i = filesystem::directory_iterator(dir); i != dir_end; ++i)
+	{
+		auto status = i->status();
+		if (filesystem::is_regular_file(status))
+		{
+			auto diskpath = StringHelper::T2A(i->path().c_str());
+			auto pckpath = StringHelper::T2A((base / i->path().filename()).c_str());
+			callback(diskpath, pckpath);
+		}
+		else if (filesystem::is_directory(status))
+		{
+			EnumDir(*i, base / i->path().filename(), callback);
+		}
+	}
+}
+
+// 计算索引表（即数据区末尾）的偏移
+// 在删除或移走数据末尾的文件时，可以回收这些空间
+void PckFile::PckFileImpl::CalcIndexTableAddr()
+{
+	m_indextableaddr = DataEnd();
+	m_freespace.Truncate(m_indextableaddr);
+}
+
+// 数据区的末尾，即所有文件数据的最大结束位置
+uint64_t PckFile::PckFileImpl::DataEnd() const
+{
+	auto& offsets = m_table.Offsets();
+	auto& sizes = m_table.CompressDataSizes();
+	uint64_t end = sizeof(_PckHead);
+	for (size_t i = 0; i < offsets.size(); ++i)
+	{
+		auto addr = offsets[i] + sizes[i];
+		if (addr > end)
+		{
+			end = addr;
+		}
+	}
+	return end;
+}
+
+// 解压全部索引，返回去重后的文件序号，同名文件保留先出现的，与查找的结果一致
+std::vector<uint32_t> PckFile::PckFileImpl::UniqueItems()
+{
+	DecodeAllItems();
+	std::vector<uint32_t> items;
+	items.reserve(m_items.size());
+	for (uint32_t i = 0; i < m_items.size(); ++i)
+	{
+		if (FindItem(ItemName(i)) == i)
+		{
+			items.push_back(i);
+		}
+	}
+	return items;
+}
+
+// 按order的顺序把src中的文件复制到新文件中，直接复制压缩数据，不解压也不重新压缩
+// 先计算出新的布局，把源位置和目标位置都连续的文件合并为一段，再分块由多个线程同时复制
+void PckFile::PckFileImpl::RebuildTo(PckFileImpl& src, const std::vector<uint32_t>& order, const std::string& newname, bool overwrite, ProcessCallback callback)
+{
+	auto pcknew = PckFile::Create(newname, overwrite);
+	auto& dst = *pcknew->pImpl;
+	auto& table = src.m_table;
+	auto total = (uint32_t)order.size();
+
+	// 计算新的布局，并把要复制的数据分块
+	struct Chunk
+	{
+		uint64_t srcpos;
+		uint64_t dstpos;
+		uint32_t len;
+		// 本块结束时已完成的文件数，用于回调
+		uint32_t done;
+	};
+	std::vector<Chunk> chunks;
+	// 每个文件在新文件中的位置，共享数据的文件在新文件中仍然共享，只复制一次
+	std::vector<uint64_t> dstoffsets(total);
+	std::unordered_map<uint64_t, uint32_t> copied;
+	uint64_t pos = sizeof(_PckHead);
+	for (uint32_t k = 0; k < total; ++k)
+	{
+		auto offset = table.Offset(order[k]);
+		uint64_t size = table.CompressDataSize(order[k]);
+		if (size > 0)
+		{
+			auto ret = copied.emplace(offset, k);
+			if (!ret.second && table.CompressDataSize(order[ret.first->second]) == size)
+			{
+				dstoffsets[k] = dstoffsets[ret.first->second];
+				continue;
+			}
+		}
+		dstoffsets[k] = pos;
+		while (size > 0)
+		{
+			if (!chunks.empty())
+			{
+				auto& last = chunks.back();
+				if (last.srcpos + last.len == offset && last.dstpos + last.len == pos && last.len < RebuildChunkSize)
+				{
+					auto n = (uint32_t)std::min<uint64_t>(size, RebuildChunkSize - last.len);
+					last.len += n;
+					last.done = k;
+					offset += n;
+					pos += n;
+					size -= n;
+					continue;
+				}
+			}
+			auto n = (uint32_t)std::min<uint64_t>(size, RebuildChunkSize);
+			chunks.push_back({ offset, pos, n, k });
+			offset += n;
+			pos += n;
+			size -= n;
+		}
+	}
+	auto dataend = pos;
+
+	// 预先设置好文件大小，之后多个线程可以同时写入不同的位置
+	dst.m_file.SetSize(dataend);
+	size_t nthread = std::thread::hardware_concurrency();
+	if (nthread == 0) nthread = 1;
+	for (size_t begin = 0; begin < chunks.size();)
+	{
+		// 每轮复制一部分数据，之后调用回调
+		auto end = begin;
+		uint64_t roundsize = 0;
+		while (end < chunks.size() && roundsize < RebuildRoundSize)
+		{
+			roundsize += chunks[end++].len;
+		}
+		std::atomic<size_t> next(begin);
+		ParallelFor(std::min(nthread, end - begin), 1, [&](size_t, size_t) {
+			std::vector<uint8_t> buf;
+			for (auto i = next++; i < end; i = next++)
+			{
+				auto& chunk = chunks[i];
+				CopyData(src.m_file, chunk.srcpos, dst.m_file, chunk.dstpos, chunk.len, buf);
+			}
+		});
+		begin = end;
+		if (callback && !callback(chunks[end - 1].done, total))
+		{
+			throw std::runtime_error("用户手动取消");
+		}
+	}
+
+	// 写入索引表
+	dst.EnsureIndexRecords();
+	for (uint32_t k = 0; k < total; ++k)
+	{
+		auto i = order[k];
+		auto size = table.CompressDataSize(i);
+		dst.AppendItem(table.Name(i), dstoffsets[k], table.DataSize(i), size);
+		dst.m_totalsize += table.DataSize(i);
+		dst.m_totalcompresssize += size;
+	}
+	auto oldaddr = dst.m_indextableaddr;
+	dst.CalcIndexTableAddr();
+	dst.WriteIndexTable(oldaddr);
+	dst.WriteHead();
+	dst.WriteTail();
+	dst.m_file.SetSize(dst.m_head.dwPckSize);
+}
+
+// 把src中[srcpos, srcpos + len)的数据复制到dst的dstpos，可以多线程同时调用
+// 优先由内核直接复制，不支持时使用buf中转
+void PckFile::PckFileImpl::CopyData(PckFileIO& src, uint64_t srcpos, PckFileIO& dst, uint64_t dstpos, uint32_t len, std::vector<uint8_t>& buf)
+{
+	while (len > 0)
+	{
+		// 源和目标在pck和pkx的分界处可能拆分在不同的位置，每次复制两边都连续的部分
+		PckFileIO::Extent e1[2], e2[2];
+		src.GetExtents(srcpos, len, e1);
+		dst.GetExtents(dstpos, len, e2);
+		auto n = std::min(e1[0].len, e2[0].len);
+		auto copied = (uint32_t)MyCopyFileRange(e1[0].file, e1[0].pos, e2[0].file, e2[0].pos, n);
+		if (copied < n)
+		{
+			auto rest = n - copied;
+			if (buf.size() < rest)
+			{
+				buf.resize(rest);
+			}
+			if (MyPRead(e1[0].file, buf.data(), rest, e1[0].pos + copied) != rest
+				|| MyPWrite(e2[0].file, buf.data(), rest, e2[0].pos + copied) != rest)
+			{
+				throw std::runtime_error("复制数据失败");
+			}
+		}
+		srcpos += n;
+		dstpos += n;
+		len -= n;
+	}
+}
+
+// 把[src, src + len)的数据移动到dst，dst必须小于src
+// 按从前到后的顺序分块复制，源和目标重叠时也不会覆盖还没有复制的数据
+void PckFile::PckFileImpl::MoveData(uint64_t src, uint64_t dst, uint64_t len, std::vector<uint8_t>& buf)
+{
+	buf.resize((size_t)std::min<uint64_t>(std::max<uint64_t>(len, buf.size()), CompactChunkSize));
+	for (uint64_t done = 0; done < len;)
+	{
+		auto n = (uint32_t)std::min<uint64_t>(len - done, buf.size());
+		m_file.Seek(src + done);
+		m_file.Read(buf.data(), n);
+		m_file.Seek(dst + done);
+		m_file.Write(buf.data(), n);
+		done += n;
+	}
+}
+
+// 释放文件的数据，被多个文件共享的数据只减少引用数
+void PckFile::PckFileImpl::FreeData(uint64_t offset, uint32_t size)
+{
+	if (size > 0 && !m_freespace.IsShared(offset))
+	{
+		m_dedup.Erase(offset);
+	}
+	m_freespace.Free(offset, size);
+}
+
+// 读取并解压指定位置的数据，不经过数据缓存也不记录访问，写入之前可以多线程同时调用
+void PckFile::PckFileImpl::ReadBlob(uint64_t offset, uint32_t compresssize, uint8_t* dest, uint32_t datasize)
+{
+	thread_local std::vector<uint8_t> scratch;
+	std::vector<uint8_t> temp;
+	auto& buf = compresssize <= MaxScratchSize ? scratch : temp;
+	if (buf.size() < compresssize)
+	{
+		buf.resize(compresssize);
+	}
+	m_file.ReadAt(offset, buf.data(), compresssize);
+	DecodeData(buf.data(), compresssize, dest, datasize);
+}
+
+// 为启用去重的待提交文件计算大小相同的已有文件的内容哈希，使它们也能被共享
+// 只在数据大小相同时才可能相同，所以不需要读取整个文件包，已经计算过的数据不再重复计算
+void PckFile::PckFileImpl::HashExistingData()
+{
+	std::unordered_set<uint64_t> sizes;
+	for (auto& p : m_pendingitems)
+	{
+		if (p->IsDedup())
+		{
+			auto n = p->PeekDataSize();
+			if (n > 0)
+				sizes.insert(n);
+		}
+	}
+	if (sizes.empty())
+	{
+		return;
+	}
+
+	std::vector<uint32_t> items;
+	std::unordered_set<uint64_t> offsets;
+	for (uint32_t i = 0; i < m_table.Size(); ++i)
+	{
+		auto offset = m_table.Offset(i);
+		if (m_table.CompressDataSize(i) > 0 && sizes.count(m_table.DataSize(i))
+			&& !m_dedup.Contains(offset) && offsets.insert(offset).second)
+		{
+			items.push_back(i);
+		}
+	}
+	m_file.Flush();
+	std::vector<uint64_t> hashes(items.size());
+	ParallelFor(items.size(), 16, [&](size_t begin, size_t end) {
+		std::vector<uint8_t> data;
+		for (auto k = begin; k < end; ++k)
+		{
+			auto i = items[k];
+			data.resize(m_table.DataSize(i));
+			ReadBlob(m_table.Offset(i), m_table.CompressDataSize(i), data.data(), data.size());
+			hashes[k] = PckHash::Hash64(data.data(), data.size());
+		}
+	});
+	for (size_t k = 0; k < items.size(); ++k)
+	{
+		auto i = items[k];
+		m_dedup.Insert(hashes[k], m_table.DataSize(i), { m_table.Offset(i), m_table.CompressDataSize(i) });
+	}
+}
+
+// 查找与item内容相同的已写入数据，哈希相同时还要比较数据，避免碰撞时共享了错误的数据
+bool PckFile::PckFileImpl::FindSharedData(PckPendingItem* item, const std::vector<uint8_t>& data, PckDedupTable::Blob& blob)
+{
+	uint64_t hash;
+	if (!item->GetContentHash(hash) || !m_dedup.Find(hash, (uint32_t)data.size(), blob))
+	{
+		return false;
+	}
+	std::vector<uint8_t> buf(data.size());
+	ReadBlob(blob.offset, blob.compresssize, buf.data(), (uint32_t)buf.size());
+	return buf == data;
+}
+
+// 数据区中实际占用的大小，共享或重叠的数据只计算一次
+uint64_t PckFile::PckFileImpl::StoredDataSize() const
+{
+	auto& offsets = m_table.Offsets();
+	auto& sizes = m_table.CompressDataSizes();
+	std::vector<uint32_t> order(offsets.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return offsets[a] < offsets[b]; });
+	uint64_t total = 0, end = 0;
+	for (auto i : order)
+	{
+		auto b = std::max<uint64_t>(offsets[i], end);
+		auto e = offsets[i] + sizes[i];
+		if (e > b)
+		{
+			total += e - b;
+			end = e;
+		}
+	}
+	return total;
+}
+
+// 把完整的索引表和文件尾写到addr，再写入文件头切换到新的索引表，调用前必须先调用EncodeIndexTable
+// 文件头只有12字节，写入文件头之前中断时，文件仍然指向原来的索引表，所以addr处的内容必须已经不再被文件中的索引使用
+void PckFile::PckFileImpl::SwitchIndexTable(uint64_t addr)
+{
+	m_indextableaddr = addr;
+	m_indextablesize = m_table.RecordsSize(m_table.Size());
+	if (m_indextablesize > 0)
+	{
+		m_file.Seek(addr);
+		m_file.Write(m_table.Record(0).data(), m_indextablesize);
+	}
+	m_head.dwPckSize = m_indextableaddr + m_indextablesize + sizeof(_PckTail);
+	WriteTail();
+	m_file.Flush();
+	WriteHead();
+	m_file.SetSize(m_head.dwPckSize);
+}
+
+// 写到addr的索引表是否会覆盖文件中当前的索引表或文件尾，调用前必须先调用EncodeIndexTable
+bool PckFile::PckFileImpl::IndexTableOverlaps(uint64_t addr) const
+{
+	auto size = m_table.RecordsSize(m_table.Size()) + sizeof(_PckTail);
+	return addr < m_head.dwPckSize && addr + size > m_indextableaddr;
+}
+
+// 为size字节的新数据分配空间，优先使用最合适的空洞，没有时追加到数据区末尾
+uint64_t PckFile::PckFileImpl::AllocateData(uint32_t size)
+{
+	auto offset = m_freespace.Allocate(size);
+	if (offset == PckFreeSpace::npos)
+	{
+		offset = m_indextableaddr;
+		m_indextableaddr += size;
+	}
+	return offset;
+}
+
+// 填写索引缓存文件头中用于校验的部分
+void PckFile::PckFileImpl::GetIndexCacheStamp(PckIndexCacheHead& head)
+{
+	auto stamp = [](const std::string& filename, uint64_t& size, int64_t& time) {
+		std::error_code ec;
+		size = 0;
+		time = 0;
+		if (filesystem::exists(filename, ec))
+		{
+			size = filesystem::file_size(filename, ec);
+			time = filesystem::last_write_time(filename, ec).time_since_epoch().count();
+		}
+	};
+	head.dwMagic = PCK_INDEXCACHE_MAGIC;
+	head.dwVersion = PCK_INDEXCACHE_VERSION;
+	stamp(m_file.GetPckFileName(), head.dwPckFileSize, head.dwPckFileTime);
+	stamp(m_file.GetPkxFileName(), head.dwPkxFileSize, head.dwPkxFileTime);
+	head.head = m_head;
+	head.tail = m_tail;
+}
+
+static uint32_t _crc32(const uint8_t* p, uint64_t len)
+{
+	uLong crc = crc32(0, Z_NULL, 0);
+	while (len > 0)
+	{
+		uInt n = (uInt)std::min<uint64_t>(len, 0x40000000);
+		crc = crc32(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return (uint32_t)crc;
+}
+
+// 从索引缓存文件加载索引，缓存不存在或已失效时返回false
+bool PckFile::PckFileImpl::LoadIndexCache()
+{
+	PckMappedFile f;
+	try
+	{
+		f.Open(m_file.GetPckFileName() + PCK_INDEXCACHE_EXT);
+	}
+	catch (...)
+	{
+		return false;
+	}
+	if (f.Size() < sizeof(PckIndexCacheHead))
+	{
+		return false;
+	}
+
+	PckIndexCacheHead head, stamp;
+	memcpy(&head, f.Data(), sizeof(head));
+	GetIndexCacheStamp(stamp);
+	if (head.dwMagic != stamp.dwMagic || head.dwVersion != stamp.dwVersion
+		|| head.dwPckFileSize != stamp.dwPckFileSize || head.dwPckFileTime != stamp.dwPckFileTime
+		|| head.dwPkxFileSize != stamp.dwPkxFileSize || head.dwPkxFileTime != stamp.dwPkxFileTime
+		|| memcmp(&head.head, &stamp.head, sizeof(_PckHead)) != 0
+		|| memcmp(&head.tail, &stamp.tail, sizeof(_PckTail)) != 0
+		|| head.dwFileCount != m_tail.dwFileCount)
+	{
+		return false;
+	}
+	uint64_t size = sizeof(PckIndexCacheHead)
+		+ (uint64_t)head.dwFileCount * sizeof(PckIndexCacheRecord)
+		+ head.dwNamePoolSize
+		+ (uint64_t)head.dwSlotCount * sizeof(PckNameIndex::Slot);
+	if (f.Size() != size || _crc32(f.Data() + sizeof(head), size - sizeof(head)) != head.dwCrc32)
+	{
+		return false;
+	}
+
+	auto records = (const PckIndexCacheRecord*)(f.Data() + sizeof(head));
+	auto names = (const char*)(records + head.dwFileCount);
+	auto slots = (const PckNameIndex::Slot*)(names + head.dwNamePoolSize);
+	for (uint32_t i = 0; i < head.dwFileCount; ++i)
+	{
+		if (records[i].dwNameLength >= MAX_PATH_PCK || (uint64_t)records[i].dwNameOffset + records[i].dwNameLength > head.dwNamePoolSize)
+		{
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < head.dwSlotCount; ++i)
+	{
+		if (slots[i].index != PckNameIndex::npos && slots[i].index >= head.dwFileCount)
+		{
+			return false;
+		}
+	}
+
+	ResetItems(head.dwFileCount);
+	for (uint32_t i = 0; i < head.dwFileCount; ++i)
+	{
+		auto& rec = records[i];
+		_PckItemIndex index {};
+		memcpy(index.szFilename, names + rec.dwNameOffset, rec.dwNameLength);
+		index.dwUnknown1 = rec.dwUnknown[0];
+		index.dwUnknown2 = rec.dwUnknown[1];
+		index.dwAddressOffset = rec.dwAddressOffset;
+		index.dwFileDataSize = rec.dwFileDataSize;
+		index.dwFileCompressDataSize = rec.dwFileCompressDataSize;
+		index.dwUnknown3 = rec.dwUnknown[2];
+		index.dwUnknown4 = rec.dwUnknown[3];
+		m_table.Set(i, index);
+	}
+	if (head.dwSlotCount > 0)
+	{
+		m_nameindex.Assign(slots, head.dwSlotCount, head.dwHasDuplicate != 0);
+	}
+	else
+	{
+		m_nameindex.Clear();
+	}
+	m_indextableaddr = m_tail.dwIndexValue ^ PCK_ADDR_MASK;
+	m_indextablesize = head.dwIndexTableSize;
+	m_totalsize = head.dwTotalDataSize;
+	m_totalcompresssize = head.dwTotalCompressDataSize;
+	return true;
+}
+
+// 生成索引缓存文件，缓存只是加速手段，失败时静默忽略
+void PckFile::PckFileImpl::SaveIndexCache()
+{
+	try
+	{
+		PckIndexCacheHead head {};
+		GetIndexCacheStamp(head);
+		head.dwIndexTableSize = m_indextablesize;
+		head.dwTotalDataSize = m_totalsize;
+		head.dwTotalCompressDataSize = m_totalcompresssize;
+		head.dwFileCount = m_items.size();
+		head.dwHasDuplicate = m_nameindex.HasDuplicate();
+
+		std::vector<PckIndexCacheRecord> records(m_items.size());
+		std::string names;
+		_PckItemIndex index;
+		for (size_t i = 0; i < m_items.size(); ++i)
+		{
+			m_table.Get(i, index);
+			auto& rec = records[i];
+			auto name = ItemName(i);
+			rec.dwAddressOffset = index.dwAddressOffset;
+			rec.dwFileDataSize = index.dwFileDataSize;
+			rec.dwFileCompressDataSize = index.dwFileCompressDataSize;
+			rec.dwUnknown[0] = index.dwUnknown1;
+			rec.dwUnknown[1] = index.dwUnknown2;
+			rec.dwUnknown[2] = index.dwUnknown3;
+			rec.dwUnknown[3] = index.dwUnknown4;
+			rec.dwNameOffset = names.size();
+			rec.dwNameLength = name.size();
+			names.append(name);
+		}
+		auto& slots = m_nameindex.Slots();
+		head.dwNamePoolSize = names.size();
+		head.dwSlotCount = slots.size();
+
+		std::vector<uint8_t> body;
+		body.reserve(records.size() * sizeof(PckIndexCacheRecord) + names.size() + slots.size() * sizeof(PckNameIndex::Slot));
+		body.insert(body.end(), (const uint8_t*)records.data(), (const uint8_t*)(records.data() + records.size()));
+		body.insert(body.end(), names.begin(), names.end());
+		body.insert(body.end(), (const uint8_t*)slots.data(), (const uint8_t*)(slots.data() + slots.size()));
+		head.dwCrc32 = _crc32(body.data(), body.size());
+
+		// 先写入临时文件再改名，避免其他进程读到写了一半的缓存
+		auto filename = m_file.GetPckFileName() + PCK_INDEXCACHE_EXT;
+		auto tmpname = filename + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+		{
+			std::ofstream f(tmpname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+			f.write((const char*)&head, sizeof(head));
+			f.write((const char*)body.data(), body.size());
+			if (f.fail())
+			{
+				throw std::runtime_error("写出文件失败");
+			}
+		}
+		std::error_code ec;
+		filesystem::rename(tmpname, filename, ec);
+		if (ec)
+		{
+			filesystem::remove(tmpname, ec);
+		}
+	}
+	catch (...)
+	{
+	}
+}
+
+// 重新分配count项空的索引，以及指向它们的文件对象
+void PckFile::PckFileImpl::ResetItems(size_t count)
+{
+	m_table.Resize(count);
+	m_items.clear();
+	m_items.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		m_items.emplace_back(PckItem(&m_table, i, m_table.Generation()));
+	}
+}
+
+void PckFile::PckFileImpl::AppendItem(std::string_view name, uint64_t offset, uint32_t size, uint32_t compresssize)
+{
+	auto i = m_table.Append(name, offset, size, compresssize);
+	m_items.emplace_back(PckItem(&m_table, i, m_table.Generation()));
+	m_nameindex.Insert(i, [this](uint32_t i) { return ItemName(i); });
+}
+
+// 标记删除第index项，只从哈希表中移除，提交结束时由SweepDeletedItems统一移除
+void PckFile::PckFileImpl::MarkItemDeleted(uint32_t index)
+{
+	if (m_deletemarks.size() < m_items.size())
+	{
+		m_deletemarks.resize(m_items.size());
+	}
+	if (m_deletemarks[index])
+	{
+		return;
+	}
+	auto getname = [this](uint32_t i) { return ItemName(i); };
+	m_nameindex.Erase(index, getname);
+	m_deletemarks[index] = 1;
+	++m_deletecount;
+	if (m_nameindex.HasDuplicate())
+	{
+		// 让被隐藏的同名文件可见，跳过已标记删除的项
+		m_nameindex.Clear();
+		m_nameindex.Reserve(m_items.size());
+		for (uint32_t i = 0; i < m_items.size(); ++i)
+		{
+			if (!IsItemDeleted(i))
+				m_nameindex.Insert(i, getname);
+		}
+	}
+}
+
+bool PckFile::PckFileImpl::IsItemDeleted(uint32_t index) const
+{
+	return index < m_deletemarks.size() && m_deletemarks[index];
+}
+
+// 一次性移除全部标记删除的项，同时更新统计信息并重建哈希表
+void PckFile::PckFileImpl::SweepDeletedItems()
+{
+	if (m_deletecount == 0)
+	{
+		return;
+	}
+	m_deletemarks.resize(m_items.size());
+	auto& sizes = m_table.DataSizes();
+	auto& compresssizes = m_table.CompressDataSizes();
+	for (size_t i = 0; i < m_deletemarks.size(); ++i)
+	{
+		if (m_deletemarks[i])
+		{
+			m_totalsize -= sizes[i];
+			m_totalcompresssize -= compresssizes[i];
+		}
+	}
+	m_table.EraseMarked(m_deletemarks);
+	m_items.erase(m_items.begin() + m_table.Size(), m_items.end());
+	// m_items[i]仍然指向第i项，只更新Generation，用户持有的旧对象随之失效
+	for (auto& item : m_items)
+	{
+		item.m_generation = m_table.Generation();
+	}
+	m_deletemarks.clear();
+	m_deletecount = 0;
+	BuildNameIndex();
+}
+
+// 在哈希表中查找文件，filename必须已经规范化
+// 延迟解压模式下，如果哈希表中找不到，则继续按顺序解压并加入哈希表，直到找到目标文件
+uint32_t PckFile::PckFileImpl::FindItem(std::string_view filename)
+{
+	auto getname = [this](uint32_t i) { return ItemName(i); };
+	auto index = m_nameindex.Find(filename, getname);
+	if (index != PckNameIndex::npos || !m_lazy)
+	{
+		return index;
+	}
+
+	std::lock_guard<std::mutex> lock(m_lazymutex);
+	if (!m_lazy)
+	{
+		return m_nameindex.Find(filename, getname);
+	}
+	while (m_lazynamed < m_items.size())
+	{
+		auto i = m_lazynamed;
+		if (!m_decoded[i])
+		{
+			DecodeLazyItem(i, *m_lazyinflater);
+		}
+		++m_lazynamed;
+		if (m_nameindex.Insert(i, getname) && PckNameIndex::EqualIgnoreCase(ItemName(i), filename))
+		{
+			index = i;
+			break;
+		}
+	}
+	if (m_lazynamed == m_items.size())
+	{
+		FinishLazyDecode();
+	}
+	return index;
+}
+
+void PckFile::PckFileImpl::BuildNameIndex()
+{
+	m_nameindex.Build(m_items.size(), [this](uint32_t i) { return ItemName(i); });
 }
 #pragma endregion
\ No newline at end of file
@@ -147,8 +147,7 @@ bool STDCALL Pck_Item_GetFileData(PckItem_c item, void* buf)
 	try
 	{
 		auto p = (PckItem*)item;
-		auto data = p->GetData();
-		memcpy(buf, data.data(), data.size());
+		p->GetData(std::span<uint8_t>((uint8_t*)buf, p->GetDataSize()));
 		return true;
 	}
 	catch (const std::exception& e)
@@ -270,6 +269,21 @@ bool STDCALL Pck_DeleteDirectory(PckFile_c pck, const char* dirname)
 	}
 }
 
+bool STDCALL Pck_RenameDirectory(PckFile_c pck, const char* dirname, const char* newname)
+{
+	PCK_RESETLASTERROR();
+	try
+	{
+		PCK_GETPTR();
+		p->RenameDirectory(dirname, newname);
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		PCK_SETLASTERROR();
+	}
+}
+
 bool STDCALL Pck_RenameItem(PckFile_c pck, PckItem_c item, const char* newname)
 {
 	PCK_RESETLASTERROR();
@@ -466,6 +480,21 @@ bool STDCALL Pck_CommitTransaction(PckFile_c pck, ProcessCallback_c callback)
 	}
 }
 
+bool STDCALL Pck_Compact(PckFile_c pck, ProcessCallback_c callback)
+{
+	PCK_RESETLASTERROR();
+	try
+	{
+		PCK_GETPTR();
+		p->Compact(callback ? [&callback](auto i, auto t) { return callback(i, t); } : std::function<bool(uint32_t, uint32_t)>());
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		PCK_SETLASTERROR();
+	}
+}
+
 bool STDCALL Pck_CreateFromDirectory(const char* filename, const char* dir, bool usedirname, bool overwrite, ProcessCallback_c callback)
 {
 	PCK_RESETLASTERROR();
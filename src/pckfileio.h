@@ -5,12 +5,34 @@
 #include <string>
 #include <stdexcept>
 #include <mutex>
+#include <atomic>
+#include <map>
+#include <span>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 #include "pckdef.h"
 #include "myfilesystem.h"
+#include "pckmmap.h"
 
+// pck文件的读写，pck文件超过PCK_MAX_SIZE的部分保存在pkx文件中
+// 两个文件组成一个连续的逻辑地址空间，由段表把逻辑地址映射到实际的文件，
+// 任意一段数据最多拆分为两次实际的读写，stdio、内存映射和pread三种读取方式共用同一个段表
+// 连续的写入先合并到写缓冲区中，缓冲区满或写入位置跳转时才实际写入文件
 class PckFileIO
 {
 public:
+	// 写缓冲区大小
+	static constexpr uint32_t WriteBufferSize = 4 * 1024 * 1024;
+
+	// 文件中的一段连续数据
+	struct Extent
+	{
+		FILE* file;
+		uint64_t pos;
+		uint32_t len;
+	};
+
 	PckFileIO() = default;
 	virtual ~PckFileIO()
 	{
@@ -26,11 +48,15 @@ public:
 		const char* mode = readonly ? "rb" : "rb+";
 		try
 		{
-			_openpck(mode);
-			if (filesystem::exists(m_pkxname))
+			_opensegment(m_segs[0], mode, 0);
+			if (m_segs[0].size > PCK_MAX_SIZE)
 			{
-				// 如果pkx文件存在，则继续打开pkx文件，并以pkx文件的打开结果为准
-				_openpkx(mode);
+				throw std::runtime_error("PCK文件尺寸超过最大值");
+			}
+			if (filesystem::exists(m_segs[1].name))
+			{
+				// 如果pkx文件存在，则继续打开pkx文件，紧接在pck文件之后
+				_opensegment(m_segs[1], mode, m_segs[0].size);
 			}
 		}
 		catch (...)
@@ -47,14 +73,14 @@ public:
 		_setfilename(filename);
 		try
 		{
-			if (filesystem::exists(m_pckname) && !overwrite)
+			if (filesystem::exists(m_segs[0].name) && !overwrite)
 			{
 				throw std::runtime_error("创建文件失败，文件已存在，且不允许重写");
 			}
 			// 先删除现有的文件
-			remove(m_pckname.c_str());
-			remove(m_pkxname.c_str());
-			_openpck("wb");
+			remove(m_segs[0].name.c_str());
+			remove(m_segs[1].name.c_str());
+			_opensegment(m_segs[0], "wb+", 0);
 			m_readonly = false;
 		}
 		catch (...)
@@ -66,102 +92,64 @@ public:
 
 	bool IsOpen()
 	{
-		return m_pckfile != NULL;
+		return m_segs[0].file != NULL;
 	}
 
 	void Close()
 	{
-		if (m_pckfile)
+		try
 		{
-			fflush(m_pckfile);
-			fclose(m_pckfile);
+			Flush();
 		}
-		if (m_pkxfile)
+		catch (...)
+		{
+		}
+		Unmap();
+		for (auto& seg : m_segs)
 		{
-			fflush(m_pkxfile);
-			fclose(m_pkxfile);
+			_closesegment(seg);
+			std::string().swap(seg.name);
 		}
-		m_pckfile = nullptr;
-		m_pkxfile = nullptr;
-		m_pcksize = 0;
-		m_pkxsize = 0;
 		m_pos = 0;
-		m_haspkx = false;
-		m_inpkx = false;
+		m_dirty = false;
 		m_readonly = true;
-		std::string().swap(m_pckname);
-		std::string().swap(m_pkxname);
+		std::vector<uint8_t>().swap(m_wbuf);
 	}
 
 	bool HasPkx()
 	{
-		return m_haspkx;
+		return m_segs[1].file != NULL;
 	}
 
-	uint64_t Size()
+	bool IsReadOnly() const noexcept
 	{
-		return m_pcksize + m_pkxsize;
+		return m_readonly;
 	}
 
-	void Seek(uint64_t pos)
+	const std::string& GetPckFileName() const noexcept
 	{
-		if (pos < m_pcksize)
-		{
-			// 位于pck文件中
-			if (fseek(m_pckfile, pos, SEEK_SET))
-			{
-				throw std::runtime_error("设置文件读写指针失败");
-			}
-			m_pos = pos;
-			m_inpkx = false;
-		}
-		else
+		return m_segs[0].name;
+	}
+
+	const std::string& GetPkxFileName() const noexcept
+	{
+		return m_segs[1].name;
+	}
+
+	uint64_t Size()
+	{
+		uint64_t size = m_segs[1].file ? m_segs[1].base + m_segs[1].size : m_segs[0].size;
+		if (!m_wbuf.empty())
 		{
-			if (m_haspkx)
-			{
-				// 位于pkx文件中
-				if (fseek(m_pkxfile, pos - m_pcksize, SEEK_SET))
-				{
-					throw std::runtime_error("设置文件读写指针失败");
-				}
-				if (pos - m_pcksize > m_pkxsize)
-				{
-					m_pkxsize = pos - m_pcksize;
-				}
-				m_pos = pos;
-				m_inpkx = true;
-			}
-			else
-			{
-				// 位于pck文件外，且没有pkx文件
-				if (pos < PCK_MAX_SIZE)
-				{
-					// 没有超过pck文件的最大尺寸
-					if (fseek(m_pckfile, pos, SEEK_SET))
-					{
-						throw std::runtime_error("设置文件读写指针失败");
-					}
-					m_pos = pos;
-					m_inpkx = false;
-					m_pcksize = pos;
-				}
-				else
-				{
-					// 超过了pck文件的最大尺寸，且不是只读模式，则创建pkx文件
-					if (!m_readonly)
-					{
-						_openpkx("wb");
-					}
-					else
-					{
-						// 如果为只读模式，则失败
-						throw std::runtime_error("设置文件读写指针失败");
-					}
-					// 创建pkx文件成功，重新seek
-					return Seek(pos);
-				}
-			}
+			// 包括还在写缓冲区中的数据
+			size = std::max<uint64_t>(size, m_wbufpos + m_wbuf.size());
 		}
+		return size;
+	}
+
+	void Seek(uint64_t pos)
+	{
+		m_pos = pos;
 	}
 
 	void Seek(uint64_t off, int way)
@@ -186,84 +174,67 @@ public:
 
 	void Read(void* buf, uint32_t len)
 	{
-		if (m_inpkx)
+		_flushwbuf();
+		Extent extents[2];
+		auto n = _split(m_pos, len, extents, false);
+		for (int i = 0; i < n; ++i)
 		{
-			// 全部数据都在pkx文件中
-			uint32_t nread = fread(buf, 1, len, m_pkxfile);
+			auto& seg = _getsegment(extents[i].file);
+			_seekfile(seg, extents[i].pos, false);
+			auto nread = fread(buf, 1, extents[i].len, seg.file);
+			seg.filepos += nread;
 			m_pos += nread;
-			if (nread != len)
+			if (nread != extents[i].len)
 			{
+				seg.filepos = -1;
 				throw std::runtime_error("读取文件失败");
 			}
-		}
-		else
-		{
-			uint32_t nread = fread(buf, 1, len, m_pckfile);
-			m_pos += nread;
-			if (nread == len)
-			{
-				if (m_pos == m_pcksize)
-				{
-					// 如果当前读写指针在pck文件末尾，需要重新seek，以便处理pkx文件
-					Seek(m_pos);
-				}
-			}
-			else
-			{
-				// 数据跨越pck和pkx
-				if (m_haspkx)
-					m_inpkx = true;
-				else
-					throw std::runtime_error("读取文件失败");
-				Read((char*)buf + nread, len - nread);
-			}
+			buf = (char*)buf + nread;
 		}
 	}
 
 	void Write(const void* buf, uint32_t len)
 	{
-		if (m_inpkx)
+		if (m_readonly)
 		{
-			// 在pkx文件中写入
-			auto nwrite = fwrite(buf, 1, len, m_pkxfile);
-			m_pos += nwrite;
-			if (nwrite != len)
-			{
-				throw std::runtime_error("写入文件失败");
-			}
-			// 更新文件尺寸
-			m_pkxsize = _getfilesize(m_pkxfile);
+			throw std::runtime_error("写入文件失败");
 		}
-		else
+		if (!m_wbuf.empty() && (m_pos != m_wbufpos + m_wbuf.size() || m_wbuf.size() + len > WriteBufferSize))
 		{
-			if (m_pos + len < PCK_MAX_SIZE)
-			{
-				// 如果pck文件还可以存下
-				auto nwrite = fwrite(buf, 1, len, m_pckfile);
-				m_pos += nwrite;
-				if (nwrite != len)
-				{
-					throw std::runtime_error("写入文件失败");
-				}
-				// 更新文件尺寸
-				m_pcksize = _getfilesize(m_pckfile);
-			}
-			else
+			// 写入位置跳转或缓冲区已满
+			_flushwbuf();
+		}
+		if (len >= WriteBufferSize)
+		{
+			// 大块数据直接写入
+			_writeat(m_pos, buf, len);
+			m_pos += len;
+			return;
+		}
+		if (m_wbuf.empty())
+		{
+			m_wbuf.reserve(WriteBufferSize);
+			m_wbufpos = m_pos;
+		}
+		m_wbuf.insert(m_wbuf.end(), (const uint8_t*)buf, (const uint8_t*)buf + len);
+		m_pos += len;
+		m_dirty = true;
+	}
+
+	// 把写缓冲区和stdio缓冲区中的数据写入文件，之后ReadAt、异步读取等不经过stdio的方式才能读到
+	void Flush()
+	{
+		if (m_dirty)
+		{
+			_flushwbuf();
+			for (auto& seg : m_segs)
 			{
-				auto len1 = PCK_MAX_SIZE - m_pos;
-				auto len2 = len - len1;
-				auto nwrite = fwrite(buf, 1, len1, m_pckfile);
-				m_pos += nwrite;
-				if (nwrite != len1)
+				if (seg.file && fflush(seg.file) != 0)
 				{
 					throw std::runtime_error("写入文件失败");
 				}
-				// 更新文件尺寸
-				m_pcksize = _getfilesize(m_pckfile);
-				// 需要重新调用下seek，处理pkx文件
-				Seek(m_pos);
-				return Write((char*)buf + len1, len2);
 			}
+			m_dirty = false;
 		}
 	}
 
@@ -273,68 +244,328 @@ public:
 		{
 			throw std::runtime_error("设置文件大小失败");
 		}
+		Flush();
 
-		Seek(len);
-
-		if (len < PCK_MAX_SIZE)
+		auto boundary = _boundary();
+		if (len <= boundary)
 		{
-			if (ftruncate(fileno(m_pckfile), len) != 0)
+			if (ftruncate(fileno(m_segs[0].file), len) != 0)
 			{
 				throw std::runtime_error("设置文件大小失败");
 			}
-			if (m_haspkx)
+			m_segs[0].size = len;
+			if (m_segs[1].file)
 			{
-				remove(m_pkxname.c_str());
-				m_haspkx = false;
+				_closesegment(m_segs[1]);
+				remove(m_segs[1].name.c_str());
 			}
-			m_pcksize = _getfilesize(m_pckfile);
-			m_pkxsize = 0;
 		}
 		else
 		{
-			if (ftruncate(fileno(m_pckfile), PCK_MAX_SIZE) != 0 || ftruncate(fileno(m_pkxfile), len - PCK_MAX_SIZE) != 0)
+			if (!m_segs[1].file)
+			{
+				_createpkx();
+			}
+			if (ftruncate(fileno(m_segs[0].file), boundary) != 0 || ftruncate(fileno(m_segs[1].file), len - boundary) != 0)
 			{
 				throw std::runtime_error("设置文件大小失败");
 			}
-			m_pcksize = _getfilesize(m_pckfile);
-			m_pkxsize = _getfilesize(m_pkxfile);
+			m_segs[0].size = boundary;
+			m_segs[1].size = len - boundary;
+		}
+		for (auto& seg : m_segs)
+		{
+			seg.filepos = -1;
+		}
+		m_pos = 0;
+	}
+
+	// 把[pos, pos + len)拆分为pck和pkx中的最多两段，返回段数，超出文件范围时抛出异常
+	// 返回的是实际的文件位置，所以会先刷新所有缓冲区
+	// 调用者会在这些位置上用MyPRead/MyPWrite定位读写，之后的顺序读写都会重新定位
+	int GetExtents(uint64_t pos, uint32_t len, Extent* extents)
+	{
+		Flush();
+		m_positional.store(true, std::memory_order_relaxed);
+		return _split(pos, len, extents, false);
+	}
+
+	// 从指定位置读取数据，不使用也不改变当前的读写指针，不需要加锁，可以多线程同时调用
+	// 如果之前写入过数据，第一次调用时会先刷新缓冲区，所以不能与写入同时进行
+	void ReadAt(uint64_t pos, void* buf, uint32_t len)
+	{
+		Extent extents[2];
+		auto n = GetExtents(pos, len, extents);
+		for (int i = 0; i < n; ++i)
+		{
+			if (MyPRead(extents[i].file, buf, extents[i].len, extents[i].pos) != extents[i].len)
+			{
+				throw std::runtime_error("读取文件失败");
+			}
+			buf = (char*)buf + extents[i].len;
+		}
+	}
+
+	// 向指定位置写入数据，不经过写缓冲区，不使用也不改变当前的读写指针，可以多线程同时写入不同的位置
+	// 写入范围必须在文件范围内，需要时先用SetSize设置好文件大小（包括创建pkx文件）
+	void WriteAt(uint64_t pos, const void* buf, uint32_t len)
+	{
+		if (m_readonly)
+		{
+			throw std::runtime_error("写入文件失败");
+		}
+		Extent extents[2];
+		auto n = GetExtents(pos, len, extents);
+		for (int i = 0; i < n; ++i)
+		{
+			if (MyPWrite(extents[i].file, buf, extents[i].len, extents[i].pos) != extents[i].len)
+			{
+				throw std::runtime_error("写入文件失败");
+			}
+			buf = (const char*)buf + extents[i].len;
+		}
+	}
+
+	// 以内存映射方式映射pck和pkx文件，只能在只读模式下使用
+	void Map()
+	{
+		if (!m_readonly)
+		{
+			throw std::runtime_error("只读模式下才能使用内存映射");
+		}
+		try
+		{
+			for (auto& seg : m_segs)
+			{
+				if (seg.file)
+				{
+					seg.map.Open(seg.name);
+				}
+			}
+		}
+		catch (...)
+		{
+			Unmap();
+			std::rethrow_exception(std::current_exception());
+		}
+		m_mapped = true;
+	}
+
+	void Unmap()
+	{
+		for (auto& seg : m_segs)
+		{
+			seg.map.Close();
 		}
+		m_bridges.clear();
+		m_mapped = false;
+	}
 
-		Seek(0);
+	bool IsMapped() const noexcept
+	{
+		return m_mapped;
 	}
 
-	std::mutex& GetMutex()
+	// 获取[pos, pos + len)的只读视图，不加锁，可以多线程同时调用
+	// 跨越pck和pkx的数据会复制到一块单独的缓冲区中，该缓冲区一直保留到取消映射，保证视图一直有效
+	std::span<const uint8_t> View(uint64_t pos, uint32_t len)
 	{
-		return m_mutex;
+		if (!m_mapped)
+		{
+			throw std::runtime_error("文件未映射");
+		}
+		Extent extents[2];
+		auto n = GetExtents(pos, len, extents);
+		if (n == 0)
+		{
+			return {};
+		}
+		if (n == 1)
+		{
+			return { _getsegment(extents[0].file).map.Data() + extents[0].pos, len };
+		}
+
+		// 数据跨越pck和pkx
+		std::lock_guard<std::mutex> lock(m_bridgemutex);
+		auto& bridge = m_bridges[{ pos, len }];
+		if (!bridge)
+		{
+			bridge.reset(new uint8_t[len]);
+			auto p = bridge.get();
+			for (int i = 0; i < n; ++i)
+			{
+				memcpy(p, _getsegment(extents[i].file).map.Data() + extents[i].pos, extents[i].len);
+				p += extents[i].len;
+			}
+		}
+		return { bridge.get(), len };
 	}
 
 private:
 	PckFileIO(const PckFileIO& a) = delete;
 	void operator=(const PckFileIO& a) = delete;
-	
-	void _openpck(const char* mode)
+
+	// 段表中的一项，对应一个实际的文件
+	struct Segment
+	{
+		std::string name;
+		FILE* file = nullptr;
+		// 在逻辑地址空间中的起始位置
+		uint64_t base = 0;
+		// 文件大小，写入时增量更新
+		uint64_t size = 0;
+		// stdio的当前位置，-1表示未知，相同时顺序读写不需要再seek
+		uint64_t filepos = -1;
+		// 上一次操作是否为写入，读写切换时必须seek
+		bool writing = false;
+		PckMappedFile map;
+	};
+
+	// 直接写入文件，不经过写缓冲区
+	void _writeat(uint64_t pos, const void* buf, uint32_t len)
+	{
+		Extent extents[2];
+		auto n = _split(pos, len, extents, true);
+		for (int i = 0; i < n; ++i)
+		{
+			auto& seg = _getsegment(extents[i].file);
+			_seekfile(seg, extents[i].pos, true);
+			auto nwrite = fwrite(buf, 1, extents[i].len, seg.file);
+			seg.filepos += nwrite;
+			m_dirty = true;
+			// 增量更新文件尺寸，不需要刷新文件
+			seg.size = std::max<uint64_t>(seg.size, seg.filepos);
+			if (nwrite != extents[i].len)
+			{
+				seg.filepos = -1;
+				throw std::runtime_error("写入文件失败");
+			}
+			buf = (const char*)buf + nwrite;
+		}
+	}
+
+	// 把写缓冲区中的数据写入文件
+	void _flushwbuf()
+	{
+		if (m_wbuf.empty())
+		{
+			return;
+		}
+		// 先清空缓冲区再写入，写入失败时丢弃缓冲区中的数据
+		std::vector<uint8_t> buf;
+		buf.swap(m_wbuf);
+		_writeat(m_wbufpos, buf.data(), buf.size());
+		buf.clear();
+		m_wbuf.swap(buf);
+	}
+
+	// pck和pkx的分界，pkx存在时为pkx的起始位置，否则为pck文件的最大尺寸
+	uint64_t _boundary()
+	{
+		return m_segs[1].file ? m_segs[1].base : PCK_MAX_SIZE;
+	}
+
+	int _split(uint64_t pos, uint32_t len, Extent* extents, bool write)
+	{
+		if (!write && pos + len > Size())
+		{
+			throw std::runtime_error("读取文件失败");
+		}
+		auto boundary = _boundary();
+		if (write && pos + len > boundary && !m_segs[1].file)
+		{
+			// 超过了pck文件的最大尺寸，创建pkx文件
+			_createpkx();
+		}
+		int n = 0;
+		if (len > 0 && pos < boundary)
+		{
+			// pck文件中的部分
+			uint32_t len1 = std::min<uint64_t>(len, boundary - pos);
+			extents[n++] = { m_segs[0].file, pos, len1 };
+			pos += len1;
+			len -= len1;
+		}
+		if (len > 0)
+		{
+			// pkx文件中的部分
+			extents[n++] = { m_segs[1].file, pos - boundary, len };
+		}
+		return n;
+	}
+
+	Segment& _getsegment(FILE* f)
+	{
+		return f == m_segs[0].file ? m_segs[0] : m_segs[1];
+	}
+
+	void _seekfile(Segment& seg, uint64_t pos, bool writing)
+	{
+		// Windows中定位读写会移动系统的文件指针，而CRT在系统的文件指针处读写，记录的位置已经不可信
+		if (m_positional.load(std::memory_order_relaxed) && m_positional.exchange(false, std::memory_order_relaxed))
+		{
+			for (auto& s : m_segs)
+			{
+				s.filepos = -1;
+			}
+		}
+		if (seg.filepos != pos || seg.writing != writing)
+		{
+			if (fseek(seg.file, pos, SEEK_SET))
+			{
+				seg.filepos = -1;
+				throw std::runtime_error("设置文件读写指针失败");
+			}
+			seg.filepos = pos;
+			seg.writing = writing;
+		}
+	}
+
+	void _opensegment(Segment& seg, const char* mode, uint64_t base)
 	{
-		m_pckfile = fopen(m_pckname.c_str(), mode);
-		if (!m_pckfile)
+		seg.file = fopen(seg.name.c_str(), mode);
+		if (!seg.file)
 		{
-			throw std::runtime_error("打开PCK文件失败");
+			throw std::runtime_error(&seg == &m_segs[0] ? "打开PCK文件失败" : "打开PKX文件失败");
 		}
-		m_pcksize = _getfilesize(m_pckfile);
-		if (m_pcksize > PCK_MAX_SIZE)
+		fseek(seg.file, 0, SEEK_END);
+		seg.size = ftell(seg.file);
+		seg.filepos = -1;
+		seg.base = base;
+	}
+
+	void _closesegment(Segment& seg)
+	{
+		if (seg.file)
 		{
-			throw std::runtime_error("PCK文件尺寸超过最大值");
+			fflush(seg.file);
+			fclose(seg.file);
 		}
+		seg.file = nullptr;
+		seg.base = 0;
+		seg.size = 0;
+		seg.filepos = -1;
 	}
-	void _openpkx(const char* mode)
+
+	// 创建pkx文件，pck文件先扩展到最大尺寸，pkx紧接在其后
+	void _createpkx()
 	{
-		m_pkxfile = fopen(m_pkxname.c_str(), mode);
-		if (!m_pkxfile)
+		if (m_readonly)
+		{
+			throw std::runtime_error("设置文件读写指针失败");
+		}
+		if (m_segs[0].size < PCK_MAX_SIZE)
 		{
-			throw std::runtime_error("打开PKX文件失败");
+			fflush(m_segs[0].file);
+			if (ftruncate(fileno(m_segs[0].file), PCK_MAX_SIZE) != 0)
+			{
+				throw std::runtime_error("设置文件大小失败");
+			}
+			m_segs[0].size = PCK_MAX_SIZE;
 		}
-		m_pkxsize = _getfilesize(m_pkxfile);
-		m_haspkx = true;
+		_opensegment(m_segs[1], "wb+", PCK_MAX_SIZE);
 	}
+
 	std::string _getpkxfilename(const char* filename)
 	{
 		std::string filename2 = filename;
@@ -342,31 +573,27 @@ private:
 		filename2[filename2.size() - 1] = 'x';
 		return filename2;
 	}
-	uint64_t _getfilesize(FILE* f)
-	{
-		uint64_t ret;
-		auto pos = ftell(f);
-		fflush(f);
-		fseek(f, 0, SEEK_END);
-		ret = ftell(f);
-		fseek(f, pos, SEEK_SET);
-		return ret;
-	}
+
 	void _setfilename(const char* filename)
 	{
-		m_pckname = filename;
-		m_pkxname = _getpkxfilename(filename);
+		m_segs[0].name = filename;
+		m_segs[1].name = _getpkxfilename(filename);
 	}
 
-	std::string m_pckname = "";
-	std::string m_pkxname = "";
-	FILE* m_pckfile = nullptr;
-	FILE* m_pkxfile = nullptr;
-	bool m_haspkx = false;
-	bool m_inpkx = false;
+	// m_segs[0]为pck文件，m_segs[1]为pkx文件
+	Segment m_segs[2];
 	bool m_readonly = true;
-	uint64_t m_pcksize = 0;
-	uint64_t m_pkxsize = 0;
 	uint64_t m_pos = 0;
-	std::mutex m_mutex;
-};
\ No newline at end of file
+	// 是否有还在写缓冲区或stdio缓冲区中的数据
+	std::atomic<bool> m_dirty { false };
+	// GetExtents之后是否还没有重新定位过，定位读写可以多线程同时进行，所以不直接修改各段的filepos
+	std::atomic<bool> m_positional { false };
+	// 写缓冲区，保存从m_wbufpos开始的连续数据
+	std::vector<uint8_t> m_wbuf;
+	uint64_t m_wbufpos = 0;
+
+	// 内存映射
+	bool m_mapped = false;
+	std::map<std::pair<uint64_t, uint32_t>, std::unique_ptr<uint8_t[]>> m_bridges;
+	std::mutex m_bridgemutex;
+};
@@ -0,0 +1,190 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <numeric>
+#include <algorithm>
+
+// 数据区中的空闲空间表，记录删除和更新文件后留下的空洞
+// 按位置保存空洞以便合并相邻的空洞，同时按大小保存以便最佳适配分配
+// 多个文件共享同一份数据（位置和大小都相同）时记录引用数，最后一个文件释放时才成为空洞
+class PckFreeSpace
+{
+public:
+	static constexpr uint64_t npos = UINT64_MAX;
+
+	bool IsBuilt() const noexcept
+	{
+		return m_built;
+	}
+
+	void Clear()
+	{
+		m_byoffset.clear();
+		m_bysize.clear();
+		m_refs.clear();
+		m_total = 0;
+		m_built = false;
+		m_overlapped = false;
+	}
+
+	// 有多个文件的数据部分重叠时，释放一个文件的数据可能破坏其他文件，此时不分配也不释放空间
+	bool IsOverlapped() const noexcept
+	{
+		return m_overlapped;
+	}
+
+	// 根据全部文件的数据位置计算[begin, end)范围内的空洞
+	void Build(const std::vector<uint64_t>& offsets, const std::vector<uint32_t>& sizes, uint64_t begin, uint64_t end)
+	{
+		Clear();
+		std::vector<uint32_t> order(offsets.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return offsets[a] < offsets[b]; });
+		auto pos = begin;
+		uint64_t prevoffset = npos;
+		uint32_t prevsize = 0;
+		for (auto i : order)
+		{
+			if (offsets[i] >= end)
+				break;
+			if (sizes[i] > 0 && offsets[i] == prevoffset && sizes[i] == prevsize)
+			{
+				++m_refs[offsets[i]];
+				continue;
+			}
+			if (sizes[i] > 0)
+			{
+				prevoffset = offsets[i];
+				prevsize = sizes[i];
+			}
+			if (offsets[i] > pos)
+				_insert(pos, offsets[i] - pos);
+			else if (offsets[i] < pos && sizes[i] > 0)
+				m_overlapped = true;
+			pos = std::max(pos, offsets[i] + sizes[i]);
+		}
+		if (pos < end)
+			_insert(pos, end - pos);
+		m_built = true;
+		if (m_overlapped)
+		{
+			m_byoffset.clear();
+			m_bysize.clear();
+			m_total = 0;
+		}
+	}
+
+	// 最佳适配：分配能容纳size的最小空洞的开头部分，没有合适的空洞时返回npos
+	uint64_t Allocate(uint64_t size)
+	{
+		if (size == 0 || m_overlapped)
+			return npos;
+		auto it = m_bysize.lower_bound({ size, 0 });
+		if (it == m_bysize.end())
+			return npos;
+		auto offset = it->second;
+		auto holesize = it->first;
+		_erase(offset, holesize);
+		if (holesize > size)
+			_insert(offset + size, holesize - size);
+		return offset;
+	}
+
+	// 又有一个文件共享offset处的数据
+	void AddRef(uint64_t offset)
+	{
+		++m_refs[offset];
+	}
+
+	// offset处的数据是否被多个文件共享，共享的数据不能原地覆盖
+	bool IsShared(uint64_t offset) const
+	{
+		return m_refs.count(offset) != 0;
+	}
+
+	// 释放[offset, offset + size)，与相邻的空洞合并，共享的数据只减少引用数
+	void Free(uint64_t offset, uint64_t size)
+	{
+		if (size == 0)
+			return;
+		auto ref = m_refs.find(offset);
+		if (ref != m_refs.end())
+		{
+			if (--ref->second == 0)
+				m_refs.erase(ref);
+			return;
+		}
+		if (m_overlapped)
+			return;
+		auto next = m_byoffset.lower_bound(offset);
+		if (next != m_byoffset.begin())
+		{
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == offset)
+			{
+				offset = prev->first;
+				size += prev->second;
+				_erase(prev->first, prev->second);
+			}
+		}
+		if (next != m_byoffset.end() && offset + size == next->first)
+		{
+			size += next->second;
+			_erase(next->first, next->second);
+		}
+		_insert(offset, size);
+	}
+
+	// 数据区缩短到end，移除end之后的空洞
+	void Truncate(uint64_t end)
+	{
+		while (!m_byoffset.empty())
+		{
+			auto last = std::prev(m_byoffset.end());
+			auto offset = last->first, size = last->second;
+			if (offset + size <= end)
+				break;
+			_erase(offset, size);
+			if (offset < end)
+				_insert(offset, end - offset);
+		}
+	}
+
+	// 空洞的总大小
+	uint64_t TotalSize() const noexcept
+	{
+		return m_total;
+	}
+
+	size_t Count() const noexcept
+	{
+		return m_byoffset.size();
+	}
+
+private:
+	void _insert(uint64_t offset, uint64_t size)
+	{
+		m_byoffset.emplace(offset, size);
+		m_bysize.emplace(size, offset);
+		m_total += size;
+	}
+
+	void _erase(uint64_t offset, uint64_t size)
+	{
+		m_byoffset.erase(offset);
+		m_bysize.erase({ size, offset });
+		m_total -= size;
+	}
+
+	std::map<uint64_t, uint64_t> m_byoffset;
+	std::set<std::pair<uint64_t, uint64_t>> m_bysize;
+	// 共享数据的位置和除第一个文件之外的引用数
+	std::unordered_map<uint64_t, uint32_t> m_refs;
+	uint64_t m_total = 0;
+	bool m_built = false;
+	bool m_overlapped = false;
+};
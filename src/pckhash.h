@@ -0,0 +1,104 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// 64位内容哈希，算法与XXH64一致，只依赖标准C++，不需要特定的指令集
+// 用于按内容查找相同的文件，不抗碰撞，命中后仍需比较数据
+class PckHash
+{
+public:
+	static uint64_t Hash64(const void* data, size_t len, uint64_t seed = 0) noexcept
+	{
+		auto p = (const uint8_t*)data;
+		auto end = p + len;
+		uint64_t h;
+		if (len >= 32)
+		{
+			uint64_t v1 = seed + P1 + P2;
+			uint64_t v2 = seed + P2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - P1;
+			auto limit = end - 32;
+			do
+			{
+				v1 = Round(v1, Read64(p));
+				v2 = Round(v2, Read64(p + 8));
+				v3 = Round(v3, Read64(p + 16));
+				v4 = Round(v4, Read64(p + 24));
+				p += 32;
+			} while (p <= limit);
+			h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+			h = Merge(h, v1);
+			h = Merge(h, v2);
+			h = Merge(h, v3);
+			h = Merge(h, v4);
+		}
+		else
+		{
+			h = seed + P5;
+		}
+		h += (uint64_t)len;
+
+		for (; p + 8 <= end; p += 8)
+		{
+			h ^= Round(0, Read64(p));
+			h = Rotl(h, 27) * P1 + P4;
+		}
+		if (p + 4 <= end)
+		{
+			h ^= (uint64_t)Read32(p) * P1;
+			h = Rotl(h, 23) * P2 + P3;
+			p += 4;
+		}
+		for (; p < end; ++p)
+		{
+			h ^= (uint64_t)*p * P5;
+			h = Rotl(h, 11) * P1;
+		}
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+	static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+	static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+	static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+	static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+	static uint64_t Rotl(uint64_t x, int r) noexcept
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	// 按小端序读取，与平台无关
+	static uint64_t Read64(const uint8_t* p) noexcept
+	{
+		return (uint64_t)Read32(p) | ((uint64_t)Read32(p + 4) << 32);
+	}
+
+	static uint32_t Read32(const uint8_t* p) noexcept
+	{
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	static uint64_t Round(uint64_t acc, uint64_t input) noexcept
+	{
+		acc += input * P2;
+		acc = Rotl(acc, 31);
+		return acc * P1;
+	}
+
+	static uint64_t Merge(uint64_t acc, uint64_t val) noexcept
+	{
+		acc ^= Round(0, val);
+		return acc * P1 + P4;
+	}
+};
@@ -1,8 +1,16 @@
 ﻿#pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "pckdef.h"
 
 // 把文件名变为pck内的标准格式
 inline std::string NormalizePckFileName(const std::string& filename)
@@ -24,3 +32,181 @@ inline std::string NormalizePckFileName(const std::string& filename)
 
 	return ret;
 }
+
+// 在原缓冲区中规范化文件名，规则同上，不分配内存
+// buf的长度为MAX_PATH_PCK，结果以0结尾，多余部分用0填充
+inline void NormalizePckFileNameInPlace(char* buf)
+{
+	size_t len = 0;
+	while (len < MAX_PATH_PCK && buf[len])
+		++len;
+	auto istrim = [](char c) { return c == ' ' || c == '\r' || c == '\n' || c == '\t' || c == '\\' || c == '/'; };
+
+	size_t begin = 0;
+	while (begin < len && istrim(buf[begin]))
+		++begin;
+	size_t n = 0;
+	for (size_t i = begin; i < len; ++i)
+	{
+		char c = buf[i] == '/' ? '\\' : buf[i];
+		if (c == '\\' && n > 0 && buf[n - 1] == '\\')
+			continue;
+		buf[n++] = c;
+	}
+	while (n > 0 && istrim(buf[n - 1]))
+		--n;
+
+	if (n > 255)
+		throw std::runtime_error("文件名长度超出限制");
+
+	std::fill(buf + n, buf + MAX_PATH_PCK, 0);
+}
+
+// 把[0, count)分成若干段，使用多个线程并行执行fn(begin, end)，线程数不超过CPU线程数
+// 任一线程抛出的异常会在所有线程结束后重新抛出
+inline void ParallelFor(size_t count, size_t mingrain, const std::function<void(size_t begin, size_t end)>& fn)
+{
+	size_t nthread = std::thread::hardware_concurrency();
+	if (nthread == 0) nthread = 1;
+	if (mingrain == 0) mingrain = 1;
+	nthread = std::min(nthread, (count + mingrain - 1) / mingrain);
+	if (nthread <= 1)
+	{
+		if (count > 0)
+			fn(0, count);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(nthread);
+	size_t step = (count + nthread - 1) / nthread;
+	for (size_t t = 0; t < nthread; ++t)
+	{
+		size_t begin = t * step;
+		size_t end = std::min(count, begin + step);
+		threads.emplace_back([&fn, &errors, t, begin, end]() {
+			try
+			{
+				fn(begin, end);
+			}
+			catch (...)
+			{
+				errors[t] = std::current_exception();
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	for (auto& e : errors)
+	{
+		if (e)
+			std::rethrow_exception(e);
+	}
+}
+
+// 在多个线程中按顺序预先处理任务，调用者再按顺序用Wait取得每个任务的结果
+// fn(i)返回任务占用的内存大小，已完成但还没有Release的任务占用的内存总量达到window时，暂停处理后面的任务
+class OrderedPrefetcher
+{
+public:
+	OrderedPrefetcher(size_t count, uint64_t window, std::function<size_t(size_t i)> fn)
+		: m_fn(std::move(fn)), m_window(window), m_slots(count)
+	{
+		size_t nthread = std::thread::hardware_concurrency();
+		nthread = std::min(nthread, count);
+		if (nthread <= 1)
+		{
+			// 单线程时在Wait中直接处理
+			return;
+		}
+		for (size_t t = 0; t < nthread; ++t)
+		{
+			m_threads.emplace_back([this] { _run(); });
+		}
+	}
+
+	~OrderedPrefetcher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		for (auto& t : m_threads)
+			t.join();
+	}
+
+	// 等待第i个任务完成，任务中抛出的异常在这里重新抛出
+	void Wait(size_t i)
+	{
+		auto& slot = m_slots[i];
+		if (m_threads.empty())
+		{
+			m_fn(i);
+			return;
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [&] { return slot.done; });
+		if (slot.error)
+			std::rethrow_exception(slot.error);
+	}
+
+	// 第i个任务的结果已经用完，释放它占用的内存额度
+	void Release(size_t i)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_inflight -= m_slots[i].bytes;
+		m_slots[i].bytes = 0;
+		m_cond.notify_all();
+	}
+
+private:
+	OrderedPrefetcher(const OrderedPrefetcher&) = delete;
+	void operator=(const OrderedPrefetcher&) = delete;
+
+	void _run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;)
+		{
+			m_cond.wait(lock, [this] { return m_stop || m_next >= m_slots.size() || m_inflight < m_window; });
+			if (m_stop || m_next >= m_slots.size())
+				return;
+			auto i = m_next++;
+			lock.unlock();
+			size_t bytes = 0;
+			std::exception_ptr error;
+			try
+			{
+				bytes = m_fn(i);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+			lock.lock();
+			m_slots[i].bytes = bytes;
+			m_slots[i].error = error;
+			m_slots[i].done = true;
+			m_inflight += bytes;
+			m_cond.notify_all();
+		}
+	}
+
+	struct Slot
+	{
+		bool done = false;
+		size_t bytes = 0;
+		std::exception_ptr error;
+	};
+
+	std::function<size_t(size_t i)> m_fn;
+	uint64_t m_window;
+	std::vector<Slot> m_slots;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	size_t m_next = 0;
+	uint64_t m_inflight = 0;
+	bool m_stop = false;
+};
@@ -0,0 +1,44 @@
+﻿#pragma once
+
+#include <cstdint>
+#include "pckdef.h"
+
+// 索引缓存文件（xxx.pck.idx）的格式
+// 文件头之后依次为：PckIndexCacheRecord[dwFileCount]、文件名字符串池、PckNameIndex::Slot[dwSlotCount]
+// 文件头中保存pck/pkx文件的大小、修改时间及文件头尾，任何一项不一致都视为缓存失效
+
+#define PCK_INDEXCACHE_MAGIC		0x58444950	// "PIDX"
+#define PCK_INDEXCACHE_VERSION		1
+#define PCK_INDEXCACHE_EXT			".idx"
+
+#pragma pack(1)
+struct PckIndexCacheHead
+{
+	uint32_t dwMagic;
+	uint32_t dwVersion;
+	uint64_t dwPckFileSize;
+	uint64_t dwPkxFileSize;
+	int64_t dwPckFileTime;
+	int64_t dwPkxFileTime;
+	_PckHead head;
+	_PckTail tail;
+	uint64_t dwIndexTableSize;
+	uint64_t dwTotalDataSize;
+	uint64_t dwTotalCompressDataSize;
+	uint32_t dwFileCount;
+	uint32_t dwNamePoolSize;
+	uint32_t dwSlotCount;
+	uint32_t dwHasDuplicate;
+	uint32_t dwCrc32;		// 文件头之后所有数据的crc32
+};
+
+struct PckIndexCacheRecord
+{
+	uint64_t dwAddressOffset;
+	uint32_t dwFileDataSize;
+	uint32_t dwFileCompressDataSize;
+	uint32_t dwUnknown[4];
+	uint32_t dwNameOffset;
+	uint32_t dwNameLength;
+};
+#pragma pack()
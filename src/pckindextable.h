@@ -0,0 +1,389 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <span>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include "pckdef.h"
+
+class PckFile;
+
+// 文件名字符串池，按块分配，已分配的字符串地址永远不变
+// 使用32位偏移引用字符串：高16位为块号，低16位为块内偏移
+class PckStringPool
+{
+public:
+	static constexpr uint32_t BlockSize = 0x10000;
+
+	// 添加字符串，返回偏移，可以多线程同时调用
+	uint32_t Add(std::string_view s)
+	{
+		if (s.size() >= MAX_PATH_PCK)
+		{
+			throw std::runtime_error("文件名长度超出限制");
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_blocks.empty() || m_used + s.size() + 1 > BlockSize)
+		{
+			if (m_blocks.size() >= 0x10000)
+			{
+				throw std::runtime_error("文件名字符串池已满");
+			}
+			m_blocks.emplace_back(new char[BlockSize]);
+			m_used = 0;
+		}
+		uint32_t off = ((uint32_t)(m_blocks.size() - 1) << 16) | m_used;
+		auto p = m_blocks.back().get() + m_used;
+		memcpy(p, s.data(), s.size());
+		p[s.size()] = 0;
+		m_used += s.size() + 1;
+		return off;
+	}
+
+	const char* Get(uint32_t off) const noexcept
+	{
+		return m_blocks[off >> 16].get() + (off & 0xFFFF);
+	}
+
+	// 预留块表的空间，保证添加字符串时不会移动块表，其他线程可以同时无锁读取
+	void Reserve(size_t count)
+	{
+		m_blocks.reserve(m_blocks.size() + count * MAX_PATH_PCK / BlockSize + 1);
+	}
+
+	void Clear()
+	{
+		std::vector<std::unique_ptr<char[]>>().swap(m_blocks);
+		m_used = 0;
+	}
+
+private:
+	std::vector<std::unique_ptr<char[]>> m_blocks;
+	uint32_t m_used = 0;
+	std::mutex m_mutex;
+};
+
+// 紧凑的索引表，按列保存所有文件的索引信息
+// 文件名保存在字符串池中，偏移、大小等保存在各自的数组中，遍历大小和偏移时缓存友好
+// PckItem只是指向本表中某一项的句柄
+class PckIndexTable
+{
+public:
+	PckIndexTable(PckFile* pck) : m_pck(pck) {}
+
+	PckFile* GetPckFile() const noexcept
+	{
+		return m_pck;
+	}
+
+	size_t Size() const noexcept
+	{
+		return m_offsets.size();
+	}
+
+	// 项的序号整体改变（清空或移除项）时加1，之前创建的PckItem随之失效
+	uint32_t Generation() const noexcept
+	{
+		return m_generation;
+	}
+
+	void Clear()
+	{
+		++m_generation;
+		std::vector<uint64_t>().swap(m_offsets);
+		std::vector<uint32_t>().swap(m_sizes);
+		std::vector<uint32_t>().swap(m_compresssizes);
+		std::vector<uint32_t>().swap(m_names);
+		std::vector<uint8_t>().swap(m_namelens);
+		m_unknown.clear();
+		m_pool.Clear();
+		ClearRecords();
+	}
+
+	// 预先分配count项，之后可以用Set多线程同时填写不同的项
+	void Resize(size_t count)
+	{
+		Clear();
+		m_offsets.resize(count);
+		m_sizes.resize(count);
+		m_compresssizes.resize(count);
+		m_namelens.resize(count);
+		m_pool.Reserve(count);
+		m_names.resize(count, m_pool.Add(""));
+	}
+
+	std::string_view Name(size_t i) const noexcept
+	{
+		return std::string_view(m_pool.Get(m_names[i]), m_namelens[i]);
+	}
+
+	const char* NameCStr(size_t i) const noexcept
+	{
+		return m_pool.Get(m_names[i]);
+	}
+
+	uint64_t Offset(size_t i) const noexcept
+	{
+		return m_offsets[i];
+	}
+
+	uint32_t DataSize(size_t i) const noexcept
+	{
+		return m_sizes[i];
+	}
+
+	uint32_t CompressDataSize(size_t i) const noexcept
+	{
+		return m_compresssizes[i];
+	}
+
+	const std::vector<uint64_t>& Offsets() const noexcept
+	{
+		return m_offsets;
+	}
+
+	const std::vector<uint32_t>& DataSizes() const noexcept
+	{
+		return m_sizes;
+	}
+
+	const std::vector<uint32_t>& CompressDataSizes() const noexcept
+	{
+		return m_compresssizes;
+	}
+
+	// 填写第i项，可以多线程同时填写不同的项
+	void Set(size_t i, const _PckItemIndex& index)
+	{
+		auto len = strnlen(index.szFilename, MAX_PATH_PCK);
+		m_names[i] = m_pool.Add(std::string_view(index.szFilename, len));
+		m_namelens[i] = (uint8_t)len;
+		m_offsets[i] = index.dwAddressOffset;
+		m_sizes[i] = index.dwFileDataSize;
+		m_compresssizes[i] = index.dwFileCompressDataSize;
+		if (index.dwUnknown1 || index.dwUnknown2 || index.dwUnknown3 || index.dwUnknown4)
+		{
+			std::lock_guard<std::mutex> lock(m_unknownmutex);
+			m_unknown[(uint32_t)i] = { index.dwUnknown1, index.dwUnknown2, index.dwUnknown3, index.dwUnknown4 };
+		}
+	}
+
+	// 还原第i项完整的索引结构，用于写入索引表
+	void Get(size_t i, _PckItemIndex& index) const
+	{
+		memset(&index, 0, sizeof(index));
+		auto name = Name(i);
+		memcpy(index.szFilename, name.data(), name.size());
+		index.dwAddressOffset = m_offsets[i];
+		index.dwFileDataSize = m_sizes[i];
+		index.dwFileCompressDataSize = m_compresssizes[i];
+		if (!m_unknown.empty())
+		{
+			auto it = m_unknown.find((uint32_t)i);
+			if (it != m_unknown.end())
+			{
+				index.dwUnknown1 = it->second[0];
+				index.dwUnknown2 = it->second[1];
+				index.dwUnknown3 = it->second[2];
+				index.dwUnknown4 = it->second[3];
+			}
+		}
+	}
+
+	// 在末尾添加一项，返回序号
+	size_t Append(std::string_view name, uint64_t offset, uint32_t size, uint32_t compresssize)
+	{
+		auto i = Size();
+		m_offsets.push_back(offset);
+		m_sizes.push_back(size);
+		m_compresssizes.push_back(compresssize);
+		m_names.push_back(m_pool.Add(name));
+		m_namelens.push_back((uint8_t)name.size());
+		if (m_hasrecords)
+		{
+			m_recordoffsets.push_back(NoRecord);
+			_changed(i);
+		}
+		return i;
+	}
+
+	// 重命名，旧文件名占用的空间不回收
+	void SetName(size_t i, std::string_view name)
+	{
+		m_names[i] = m_pool.Add(name);
+		m_namelens[i] = (uint8_t)name.size();
+		_dirty(i);
+	}
+
+	void SetLocation(size_t i, uint64_t offset, uint32_t size, uint32_t compresssize)
+	{
+		m_offsets[i] = offset;
+		m_sizes[i] = size;
+		m_compresssizes[i] = compresssize;
+		_dirty(i);
+	}
+
+	// 一次性移除所有标记的项，marks[i]非0表示移除第i项，其余的项保持原来的顺序
+	void EraseMarked(const std::vector<uint8_t>& marks)
+	{
+		size_t count = Size();
+		size_t j = 0, first = count;
+		std::unordered_map<uint32_t, std::array<uint32_t, 4>> unknown;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (marks[i])
+			{
+				if (first == count)
+					first = i;
+				continue;
+			}
+			m_offsets[j] = m_offsets[i];
+			m_sizes[j] = m_sizes[i];
+			m_compresssizes[j] = m_compresssizes[i];
+			m_names[j] = m_names[i];
+			m_namelens[j] = m_namelens[i];
+			if (m_hasrecords)
+			{
+				// 后面的项原样保留，只是位置前移，写入时整体复制
+				m_recordoffsets[j] = m_recordoffsets[i];
+			}
+			if (!m_unknown.empty())
+			{
+				auto it = m_unknown.find((uint32_t)i);
+				if (it != m_unknown.end())
+					unknown.emplace((uint32_t)j, it->second);
+			}
+			++j;
+		}
+		if (first == count)
+		{
+			return;
+		}
+		++m_generation;
+		m_offsets.resize(j);
+		m_sizes.resize(j);
+		m_compresssizes.resize(j);
+		m_names.resize(j);
+		m_namelens.resize(j);
+		m_unknown.swap(unknown);
+		if (m_hasrecords)
+		{
+			m_recordoffsets.resize(j);
+			_changed(first);
+		}
+	}
+
+	// 索引记录缓存：保存每一项写入文件时的原始数据（包括8字节长度前缀）
+	// 写入索引表时，修改过的项重新压缩，其余的项直接复制
+	// 从第一个变化的项开始，之前的记录在文件中的位置和内容都不变，索引表不移动时不需要重写
+	static constexpr uint32_t NoRecord = 0xFFFFFFFF;
+
+	bool HasRecords() const noexcept
+	{
+		return m_hasrecords;
+	}
+
+	// 导入与当前各项一一对应的原始索引数据，offsets为每一项在buf中的偏移，且按顺序连续排列
+	void SetRecords(std::vector<uint8_t>&& buf, std::vector<uint32_t>&& offsets)
+	{
+		if (offsets.size() != Size())
+		{
+			throw std::runtime_error("索引记录数量错误");
+		}
+		m_recordbuf = std::move(buf);
+		m_recordoffsets = std::move(offsets);
+		m_hasrecords = true;
+		m_firstchanged = Size();
+	}
+
+	void ClearRecords()
+	{
+		std::vector<uint8_t>().swap(m_recordbuf);
+		std::vector<uint32_t>().swap(m_recordoffsets);
+		m_hasrecords = false;
+		m_firstchanged = 0;
+	}
+
+	// 第i项的原始索引数据，修改过的项返回空
+	std::span<const uint8_t> Record(size_t i) const noexcept
+	{
+		auto off = m_recordoffsets[i];
+		if (off == NoRecord)
+			return {};
+		uint32_t len;
+		memcpy(&len, m_recordbuf.data() + off, 4);
+		return std::span<const uint8_t>(m_recordbuf.data() + off, (len ^ PCK_INDEX_MASK1) + 8);
+	}
+
+	// 第一个变化的项，之前的项都没有修改且位置不变，没有变化时返回Size()
+	size_t FirstChangedRecord() const noexcept
+	{
+		return m_firstchanged;
+	}
+
+	// 前count项在索引表中占用的长度，这些项必须都没有修改过
+	size_t RecordsSize(size_t count) const noexcept
+	{
+		if (count == 0)
+			return 0;
+		auto r = Record(count - 1);
+		return r.data() - m_recordbuf.data() + r.size();
+	}
+
+	// 写入索引表后，用[first, Size())各项新的原始数据替换原来的记录
+	void CommitRecords(size_t first, const std::vector<uint8_t>& buf, const std::vector<uint32_t>& offsets)
+	{
+		auto prefix = RecordsSize(first);
+		m_recordbuf.resize(prefix);
+		m_recordbuf.insert(m_recordbuf.end(), buf.begin(), buf.end());
+		m_recordoffsets.resize(first);
+		for (auto off : offsets)
+		{
+			m_recordoffsets.push_back(prefix + off);
+		}
+		m_firstchanged = Size();
+	}
+
+private:
+	PckIndexTable(const PckIndexTable&) = delete;
+	void operator=(const PckIndexTable&) = delete;
+
+	PckFile* m_pck;
+	std::vector<uint64_t> m_offsets;
+	std::vector<uint32_t> m_sizes;
+	std::vector<uint32_t> m_compresssizes;
+	std::vector<uint32_t> m_names;
+	std::vector<uint8_t> m_namelens;
+	// 极少出现的未知字段，只保存非0的项
+	std::unordered_map<uint32_t, std::array<uint32_t, 4>> m_unknown;
+	std::mutex m_unknownmutex;
+	PckStringPool m_pool;
+	// 索引记录缓存
+	std::vector<uint8_t> m_recordbuf;
+	std::vector<uint32_t> m_recordoffsets;
+	bool m_hasrecords = false;
+	size_t m_firstchanged = 0;
+	uint32_t m_generation = 0;
+
+	void _changed(size_t i) noexcept
+	{
+		if (i < m_firstchanged)
+			m_firstchanged = i;
+	}
+
+	void _dirty(size_t i) noexcept
+	{
+		if (m_hasrecords)
+		{
+			m_recordoffsets[i] = NoRecord;
+			_changed(i);
+		}
+	}
+};
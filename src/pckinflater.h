@@ -0,0 +1,52 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <zlib.h>
+
+// 可重复使用的zlib解压器，避免每次调用uncompress都重新分配解压状态
+class PckInflater
+{
+public:
+	PckInflater()
+	{
+		if (inflateInit(&m_stream) != Z_OK)
+		{
+			throw std::runtime_error("初始化解压器失败");
+		}
+	}
+
+	~PckInflater()
+	{
+		inflateEnd(&m_stream);
+	}
+
+	// 解压完整的zlib数据流，成功返回true，destlen返回实际解压的长度
+	// 与uncompress的行为一致：数据流必须完整结束，且输出缓冲区足够大
+	bool Inflate(void* dest, uint32_t& destlen, const void* src, uint32_t srclen)
+	{
+		if (inflateReset(&m_stream) != Z_OK)
+		{
+			return false;
+		}
+		// 与uncompress一样，输出为空时使用一个字节的临时缓冲区，以便检测数据流是否完整
+		Bytef dummy;
+		m_stream.next_in = (Bytef*)src;
+		m_stream.avail_in = srclen;
+		m_stream.next_out = destlen ? (Bytef*)dest : &dummy;
+		m_stream.avail_out = destlen ? destlen : 1;
+		auto ret = inflate(&m_stream, Z_FINISH);
+		if (ret != Z_STREAM_END || m_stream.total_out > destlen)
+		{
+			return false;
+		}
+		destlen = (uint32_t)m_stream.total_out;
+		return true;
+	}
+
+private:
+	PckInflater(const PckInflater&) = delete;
+	void operator=(const PckInflater&) = delete;
+
+	z_stream m_stream {};
+};
@@ -1,41 +1,67 @@
 ﻿#include "pckitem.h"
 #include "pckfile.h"
+#include "pckindextable.h"
+
+void PckItem::CheckValid() const
+{
+#ifndef NDEBUG
+	if (m_table && m_generation != m_table->Generation())
+	{
+		throw std::logic_error("文件对象已失效，删除文件后需要重新获取");
+	}
+#endif
+}
 
 const char* PckItem::GetFileName() const
 {
-	return m_index.szFilename;
+	CheckValid();
+	return m_table ? m_table->NameCStr(m_index) : "";
 }
 
 uint32_t PckItem::GetDataSize() const
 {
-	return m_index.dwFileDataSize;
+	CheckValid();
+	return m_table ? m_table->DataSize(m_index) : 0;
 }
 
 uint32_t PckItem::GetCompressDataSize() const
 {
-	return m_index.dwFileCompressDataSize;
+	CheckValid();
+	return m_table ? m_table->CompressDataSize(m_index) : 0;
 }
 
 std::vector<uint8_t> PckItem::GetCompressData() const
 {
-	if (auto p = m_pck.lock())
+	if (!m_table)
 	{
-		return p->GetSingleFileCompressData(*this);
+		throw std::runtime_error("无效的文件对象");
 	}
-	else
+	return m_table->GetPckFile()->GetSingleFileCompressData(*this);
+}
+
+std::vector<uint8_t> PckItem::GetData() const
+{
+	if (!m_table)
 	{
-		throw std::runtime_error("PckFile对象已释放");
+		throw std::runtime_error("无效的文件对象");
 	}
+	return m_table->GetPckFile()->GetSingleFileData(*this);
 }
 
-std::vector<uint8_t> PckItem::GetData() const
+uint32_t PckItem::GetData(std::span<uint8_t> buf) const
 {
-	if (auto p = m_pck.lock())
+	if (!m_table)
 	{
-		return p->GetSingleFileData(*this);
+		throw std::runtime_error("无效的文件对象");
 	}
-	else
+	return m_table->GetPckFile()->GetSingleFileData(*this, buf);
+}
+
+void PckItem::GetData(std::vector<uint8_t>& buf) const
+{
+	if (!m_table)
 	{
-		throw std::runtime_error("PckFile对象已释放");
+		throw std::runtime_error("无效的文件对象");
 	}
+	m_table->GetPckFile()->GetSingleFileData(*this, buf);
 }
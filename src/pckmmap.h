@@ -0,0 +1,132 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+#if defined(_WINDOWS) || defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// 只读的内存映射文件
+class PckMappedFile
+{
+public:
+	PckMappedFile() = default;
+	~PckMappedFile()
+	{
+		Close();
+	}
+
+	// 映射整个文件，失败抛出异常
+	void Open(const std::string& filename)
+	{
+		Close();
+#if defined(_WINDOWS) || defined(_WIN32)
+		m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			throw std::runtime_error("打开文件失败");
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size))
+		{
+			Close();
+			throw std::runtime_error("获取文件大小失败");
+		}
+		m_size = size.QuadPart;
+		if (m_size > 0)
+		{
+			m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (m_mapping == NULL)
+			{
+				Close();
+				throw std::runtime_error("映射文件失败");
+			}
+			m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+			if (m_data == nullptr)
+			{
+				Close();
+				throw std::runtime_error("映射文件失败");
+			}
+		}
+#else
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			throw std::runtime_error("打开文件失败");
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("获取文件大小失败");
+		}
+		m_size = st.st_size;
+		if (m_size > 0)
+		{
+			auto p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED)
+			{
+				close(fd);
+				m_size = 0;
+				throw std::runtime_error("映射文件失败");
+			}
+			m_data = (const uint8_t*)p;
+		}
+		close(fd);
+#endif
+	}
+
+	void Close()
+	{
+#if defined(_WINDOWS) || defined(_WIN32)
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping != NULL)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+		m_mapping = NULL;
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_data)
+			munmap((void*)m_data, m_size);
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+
+	bool IsOpen() const noexcept
+	{
+		return m_data != nullptr;
+	}
+
+	const uint8_t* Data() const noexcept
+	{
+		return m_data;
+	}
+
+	uint64_t Size() const noexcept
+	{
+		return m_size;
+	}
+
+private:
+	PckMappedFile(const PckMappedFile&) = delete;
+	void operator=(const PckMappedFile&) = delete;
+
+	const uint8_t* m_data = nullptr;
+	uint64_t m_size = 0;
+#if defined(_WINDOWS) || defined(_WIN32)
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = NULL;
+#endif
+};
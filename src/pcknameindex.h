@@ -0,0 +1,234 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <stdexcept>
+#include <vector>
+
+// 不区分大小写的文件名哈希表
+// 表中只保存文件在列表中的序号和文件名的哈希值，文件名本身由调用者通过 getname(index) 提供，
+// 这样列表重新分配内存时不会使哈希表失效，且查找时不需要构造任何临时字符串
+class PckNameIndex
+{
+public:
+	static constexpr uint32_t npos = 0xFFFFFFFF;
+
+	struct Slot
+	{
+		uint32_t hash = 0;
+		uint32_t index = npos;
+	};
+
+	// 与 StringHelper::CompareIgnoreCase 一致，只转换ASCII大写字母
+	static char ToLower(char c) noexcept
+	{
+		return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	}
+
+	// FNV-1a
+	static uint32_t Hash(std::string_view s) noexcept
+	{
+		uint32_t h = 2166136261u;
+		for (auto c : s)
+		{
+			h ^= (uint8_t)ToLower(c);
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	static bool EqualIgnoreCase(std::string_view s1, std::string_view s2) noexcept
+	{
+		if (s1.size() != s2.size())
+			return false;
+		for (size_t i = 0; i < s1.size(); ++i)
+		{
+			if (ToLower(s1[i]) != ToLower(s2[i]))
+				return false;
+		}
+		return true;
+	}
+
+	// 不区分大小写的字典序比较，与 StringHelper::CompareIgnoreCase(s1, s2) < 0 一致，但不需要复制字符串
+	static bool LessIgnoreCase(std::string_view s1, std::string_view s2) noexcept
+	{
+		auto n = s1.size() < s2.size() ? s1.size() : s2.size();
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto c1 = (uint8_t)ToLower(s1[i]), c2 = (uint8_t)ToLower(s2[i]);
+			if (c1 != c2)
+				return c1 < c2;
+		}
+		return s1.size() < s2.size();
+	}
+
+	void Clear() noexcept
+	{
+		std::vector<Slot>().swap(m_slots);
+		m_size = 0;
+		m_hasdup = false;
+	}
+
+	size_t Size() const noexcept
+	{
+		return m_size;
+	}
+
+	// 预留空间，保证装载因子不超过0.5
+	void Reserve(size_t n)
+	{
+		size_t cap = 16;
+		while (cap < n * 2)
+			cap <<= 1;
+		if (cap > m_slots.size())
+			_rehash(cap);
+	}
+
+	// 查找文件，返回文件序号，找不到返回npos
+	template <typename GetName>
+	uint32_t Find(std::string_view name, GetName&& getname) const
+	{
+		if (m_size == 0)
+			return npos;
+		auto h = Hash(name);
+		auto mask = m_slots.size() - 1;
+		for (auto i = h & mask; ; i = (i + 1) & mask)
+		{
+			auto& slot = m_slots[i];
+			if (slot.index == npos)
+				return npos;
+			if (slot.hash == h && EqualIgnoreCase(getname(slot.index), name))
+				return slot.index;
+		}
+	}
+
+	// 插入文件，如果已存在同名文件则不插入并返回false
+	// 保留先出现的文件，与按顺序线性查找的结果一致
+	template <typename GetName>
+	bool Insert(uint32_t index, GetName&& getname)
+	{
+		Reserve(m_size + 1);
+		auto name = getname(index);
+		auto h = Hash(name);
+		auto mask = m_slots.size() - 1;
+		for (auto i = h & mask; ; i = (i + 1) & mask)
+		{
+			auto& slot = m_slots[i];
+			if (slot.index == npos)
+			{
+				slot.hash = h;
+				slot.index = index;
+				++m_size;
+				return true;
+			}
+			if (slot.hash == h && EqualIgnoreCase(getname(slot.index), name))
+			{
+				m_hasdup = true;
+				return false;
+			}
+		}
+	}
+
+	// 移除文件，调用时 getname(index) 必须还是移除前的文件名
+	template <typename GetName>
+	void Erase(uint32_t index, GetName&& getname)
+	{
+		if (m_size == 0)
+			return;
+		auto mask = m_slots.size() - 1;
+		auto i = Hash(getname(index)) & mask;
+		for (; ; i = (i + 1) & mask)
+		{
+			if (m_slots[i].index == npos)
+				return;
+			if (m_slots[i].index == index)
+				break;
+		}
+		// 线性探测的删除：把后续同一探测链上的元素前移，避免使用墓碑
+		for (auto j = (i + 1) & mask; m_slots[j].index != npos; j = (j + 1) & mask)
+		{
+			auto home = m_slots[j].hash & mask;
+			if (((j - home) & mask) >= ((j - i) & mask))
+			{
+				m_slots[i] = m_slots[j];
+				i = j;
+			}
+		}
+		m_slots[i].index = npos;
+		--m_size;
+	}
+
+	// 移除文件，并把所有大于index的序号减1，对应列表中erase一个元素
+	template <typename GetName>
+	void EraseAndShift(uint32_t index, GetName&& getname)
+	{
+		Erase(index, getname);
+		for (auto& slot : m_slots)
+		{
+			if (slot.index != npos && slot.index > index)
+				--slot.index;
+		}
+	}
+
+	// 按顺序重建整个哈希表
+	template <typename GetName>
+	void Build(uint32_t count, GetName&& getname)
+	{
+		Clear();
+		Reserve(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			Insert(i, getname);
+		}
+	}
+
+	// 是否存在被隐藏的同名文件，此时移除文件后需要重建哈希表，才能让后面的同名文件可见
+	bool HasDuplicate() const noexcept
+	{
+		return m_hasdup;
+	}
+
+	// 导出和导入哈希表的内容，用于索引缓存文件
+	const std::vector<Slot>& Slots() const noexcept
+	{
+		return m_slots;
+	}
+
+	// 导入事先构建好的哈希表，slots的数量必须是2的幂
+	void Assign(const Slot* slots, size_t count, bool hasdup)
+	{
+		if (count == 0 || (count & (count - 1)) != 0)
+		{
+			throw std::runtime_error("哈希表大小错误");
+		}
+		m_slots.assign(slots, slots + count);
+		m_size = 0;
+		for (auto& slot : m_slots)
+		{
+			if (slot.index != npos)
+				++m_size;
+		}
+		m_hasdup = hasdup;
+	}
+
+private:
+	void _rehash(size_t cap)
+	{
+		std::vector<Slot> slots(cap);
+		auto mask = cap - 1;
+		for (auto& slot : m_slots)
+		{
+			if (slot.index == npos)
+				continue;
+			auto i = slot.hash & mask;
+			while (slots[i].index != npos)
+				i = (i + 1) & mask;
+			slots[i] = slot;
+		}
+		m_slots.swap(slots);
+	}
+
+	std::vector<Slot> m_slots;
+	size_t m_size = 0;
+	bool m_hasdup = false;
+};
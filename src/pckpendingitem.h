@@ -7,6 +7,12 @@
 #include <memory>
 #include <zlib.h>
 #include "pckitem.h"
+#include "pckfile.h"
+#include "pckindextable.h"
+#include "pckcompressor.h"
+#include "pckdedup.h"
+#include "pckhash.h"
+#include "myfilesystem.h"
 
 enum class PckPendingActionType {
 	Add,
@@ -23,11 +29,113 @@ public:
 
 	PckPendingActionType GetType() { return m_action; }
 
+	// 提交事务时在工作线程中调用，预先读取和压缩数据，返回大致占用的内存大小
+	virtual size_t Prepare() { return 0; }
+
 	// 在用完后随即调用，释放临时数据，避免重建操作时内存溢出
 	virtual void Release() = 0;
 
+	// 提交事务前调用，设置压缩统计、去重表，以及文件自己没有指定压缩策略时使用的策略
+	void SetCommitContext(const PckFile::CompressPolicy* policy, PckCompressStats* stats, PckDedupTable* dedup) noexcept
+	{
+		m_commitpolicy = policy;
+		m_stats = stats;
+		m_dedup = dedup;
+	}
+
+	// 是否按内容去重
+	virtual bool IsDedup() const noexcept
+	{
+		auto policy = GetPolicy();
+		return m_dedup && policy && policy->dedup;
+	}
+
+	// 不读取数据，预先获取数据大小，用于在提交前找出可能相同的已有文件
+	virtual uint64_t PeekDataSize() { return 0; }
+
+	// Prepare计算出的内容哈希，没有计算时返回false
+	bool GetContentHash(uint64_t& hash) const noexcept
+	{
+		hash = m_hash;
+		return m_hashed;
+	}
+
+	// 写入数据后调用，累计压缩统计
+	void CountWritten(uint32_t datasize, uint32_t written) noexcept
+	{
+		if (m_stats)
+			m_stats->Add(!m_raw, m_probed, datasize, written);
+	}
+
+	// 共享已有的数据而没有写入时调用
+	void CountDeduped(uint32_t datasize) noexcept
+	{
+		if (m_stats)
+			m_stats->AddDeduped(datasize);
+	}
+
+protected:
+	typedef std::shared_ptr<const PckFile::CompressPolicy> PolicyPtr;
+
+	void SetPolicy(PolicyPtr policy) noexcept
+	{
+		m_policy = std::move(policy);
+	}
+
+	const PckFile::CompressPolicy* GetPolicy() const noexcept
+	{
+		return m_policy ? m_policy.get() : m_commitpolicy;
+	}
+
+	// 在工作线程中预先压缩数据，去重时先计算内容哈希，已有相同内容的文件时跳过压缩，返回大致占用的内存大小
+	size_t PrepareData(const std::vector<uint8_t>& data, std::string_view filename)
+	{
+		if (IsDedup() && !data.empty())
+		{
+			m_hash = PckHash::Hash64(data.data(), data.size());
+			m_hashed = true;
+			if (!m_dedup->Claim(m_hash, (uint32_t)data.size()))
+			{
+				return data.size();
+			}
+		}
+		return Compress(data, filename).size() + data.size();
+	}
+
+	// 按压缩策略压缩数据，只压缩一次，返回压缩后的数据，或者在应保存原始数据时返回data本身
+	const std::vector<uint8_t>& Compress(const std::vector<uint8_t>& data, std::string_view filename)
+	{
+		if (!m_compressed)
+		{
+			auto start = std::chrono::steady_clock::now();
+			m_raw = !PckCompressor::Compress(data, m_compressdata, filename, GetPolicy(), m_probed);
+			m_compressed = true;
+			if (m_stats)
+			{
+				m_stats->AddTime(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			}
+		}
+		return m_raw ? data : m_compressdata;
+	}
+
+	void ReleaseCompressData()
+	{
+		std::vector<uint8_t>().swap(m_compressdata);
+		m_compressed = false;
+	}
+
 private:
 	PckPendingActionType m_action;
+	PolicyPtr m_policy;
+	const PckFile::CompressPolicy* m_commitpolicy = nullptr;
+	PckCompressStats* m_stats = nullptr;
+	PckDedupTable* m_dedup = nullptr;
+	uint64_t m_hash = 0;
+	bool m_hashed = false;
+	std::vector<uint8_t> m_compressdata;
+	bool m_compressed = false;
+	bool m_raw = false;
+	bool m_probed = false;
 };
 
 class PckPendingItem_Add : public PckPendingItem
@@ -41,7 +149,14 @@ public:
 
 	const std::string& GetFileName() const noexcept	{ return m_filename; }
 	virtual uint32_t GetDataSize() = 0;
-	virtual const std::vector<uint8_t>& GetCompressData(int level = Z_DEFAULT_COMPRESSION) = 0;
+	virtual const std::vector<uint8_t>& GetCompressData() = 0;
+	// 原始数据，只在去重时用于比较内容
+	virtual const std::vector<uint8_t>& GetData() = 0;
+
+	virtual size_t Prepare() override
+	{
+		return PrepareData(GetData(), GetFileName());
+	}
 
 	virtual void Release() override
 	{
@@ -55,10 +170,11 @@ private:
 class PckPendingItem_AddBuffer : public PckPendingItem_Add
 {
 public:
-	PckPendingItem_AddBuffer(const std::string& filename, const void* buf, uint32_t len)
+	PckPendingItem_AddBuffer(const std::string& filename, const void* buf, uint32_t len, PolicyPtr policy = nullptr)
 		: PckPendingItem_Add(filename)
 		, m_data((uint8_t*)buf, (uint8_t*)buf + len)
 	{
+		SetPolicy(std::move(policy));
 	}
 
 	virtual uint32_t GetDataSize() override
@@ -66,46 +182,41 @@ public:
 		return m_data.size();
 	}
 
-	virtual const std::vector<uint8_t>& GetCompressData(int level = Z_DEFAULT_COMPRESSION) override
+	virtual uint64_t PeekDataSize() override
 	{
-		if (GetDataSize() < PCK_BEGINCOMPRESS_SIZE)
-		{
-			return m_data;
-		}
+		return m_data.size();
+	}
 
-		if (m_compressdata.empty())
-		{
-			auto len = compressBound(m_data.size());
-			m_compressdata.resize(len);
-			auto ret = compress2(m_compressdata.data(), &len, m_data.data(), m_data.size(), level);
-			if (ret != Z_OK)
-			{
-				throw std::runtime_error("压缩数据失败");
-			}
-			m_compressdata.resize(len);
-		}
-		return m_compressdata;
+	virtual const std::vector<uint8_t>& GetData() override
+	{
+		return m_data;
+	}
+
+	virtual const std::vector<uint8_t>& GetCompressData() override
+	{
+		GetDataSize();
+		return Compress(m_data, GetFileName());
 	}
 
 	virtual void Release() override
 	{
 		PckPendingItem_Add::Release();
 		std::vector<uint8_t>().swap(m_data);
-		std::vector<uint8_t>().swap(m_compressdata);
+		ReleaseCompressData();
 	}
 
 private:
 	std::vector<uint8_t> m_data;
-	std::vector<uint8_t> m_compressdata;
 };
 
 class PckPendingItem_AddFile : public PckPendingItem_Add
 {
 public:
-	PckPendingItem_AddFile(const std::string& filename, const std::string& diskfile)
+	PckPendingItem_AddFile(const std::string& filename, const std::string& diskfile, PolicyPtr policy = nullptr)
 		: PckPendingItem_Add(filename)
 		, m_diskfile(diskfile)
 	{
+		SetPolicy(std::move(policy));
 	}
 
 	virtual uint32_t GetDataSize() override
@@ -129,25 +240,21 @@ public:
 		return m_data.size();
 	}
 
-	virtual const std::vector<uint8_t>& GetCompressData(int level = Z_DEFAULT_COMPRESSION) override
+	virtual uint64_t PeekDataSize() override
 	{
-		if (GetDataSize() < PCK_BEGINCOMPRESS_SIZE)
-		{
-			return m_data;
-		}
+		return m_data.empty() ? MyGetFileSize(m_diskfile.c_str()) : m_data.size();
+	}
 
-		if (m_compressdata.empty())
-		{
-			auto len = compressBound(m_data.size());
-			m_compressdata.resize(len);
-			auto ret = compress2(m_compressdata.data(), &len, m_data.data(), m_data.size(), level);
-			if (ret != Z_OK)
-			{
-				throw std::runtime_error("压缩数据失败");
-			}
-			m_compressdata.resize(len);
-		}
-		return m_compressdata;
+	virtual const std::vector<uint8_t>& GetData() override
+	{
+		GetDataSize();
+		return m_data;
+	}
+
+	virtual const std::vector<uint8_t>& GetCompressData() override
+	{
+		GetDataSize();
+		return Compress(m_data, GetFileName());
 	}
 
 	virtual void Release() override
@@ -155,13 +262,12 @@ public:
 		PckPendingItem_Add::Release();
 		std::string().swap(m_diskfile);
 		std::vector<uint8_t>().swap(m_data);
-		std::vector<uint8_t>().swap(m_compressdata);
+		ReleaseCompressData();
 	}
 
 private:
 	std::string m_diskfile;
 	std::vector<uint8_t> m_data;
-	std::vector<uint8_t> m_compressdata;
 };
 
 class PckPendingItem_AddPckItem : public PckPendingItem_Add
@@ -171,6 +277,11 @@ public:
 		: PckPendingItem_Add(item.GetFileName())
 		, m_item(item)
 	{
+		// 持有源PckFile对象，保证提交事务前文件对象一直有效
+		if (item.m_table)
+		{
+			m_source = item.m_table->GetPckFile()->shared_from_this();
+		}
 	}
 
 	virtual uint32_t GetDataSize() override
@@ -178,7 +289,24 @@ public:
 		return m_item.GetDataSize();
 	}
 
-	virtual const std::vector<uint8_t>& GetCompressData(int level = Z_DEFAULT_COMPRESSION) override
+	// 直接复制压缩数据，不参与去重
+	virtual bool IsDedup() const noexcept override
+	{
+		return false;
+	}
+
+	virtual size_t Prepare() override
+	{
+		return GetCompressData().size() + GetDataSize();
+	}
+
+	virtual const std::vector<uint8_t>& GetData() override
+	{
+		throw std::logic_error("不支持读取原始数据");
+	}
+
+	// 直接复制源文件的压缩数据，不重新压缩
+	virtual const std::vector<uint8_t>& GetCompressData() override
 	{
 		if (m_compressdata.empty())
 		{
@@ -191,10 +319,12 @@ public:
 	{
 		PckPendingItem_Add::Release();
 		std::vector<uint8_t>().swap(m_compressdata);
+		m_source.reset();
 	}
 
 private:
 	PckItem m_item;
+	std::shared_ptr<PckFile> m_source;
 	std::vector<uint8_t> m_compressdata;
 };
 
@@ -225,14 +355,16 @@ class PckPendingItem_Rename : public PckPendingItem
 public:
 	PckPendingItem_Rename(const PckItem& item, const std::string& newname)
 		: PckPendingItem(PckPendingActionType::Rename)
-		, m_item(item)
+		, m_index(item.m_index)
 		, m_name(newname)
 	{
+		item.CheckValid();
 	}
 
-	const PckItem& GetItem() const noexcept
+	// 文件在索引表中的序号，提交事务期间序号不变
+	uint32_t GetIndex() const noexcept
 	{
-		return m_item;
+		return m_index;
 	}
 
 	const std::string& GetNewFileName() const noexcept
@@ -246,63 +378,56 @@ public:
 	}
 
 private:
-	const PckItem& m_item;
+	uint32_t m_index;
 	std::string m_name;
 };
 
 class PckPendingItem_Update : public PckPendingItem
 {
 public:
-	PckPendingItem_Update(const PckItem& item)
+	PckPendingItem_Update(const PckItem& item, PolicyPtr policy)
 		: PckPendingItem(PckPendingActionType::Update)
-		, m_item(item)
+		, m_index(item.m_index)
+		, m_filename(item.GetFileName())
 	{
+		SetPolicy(std::move(policy));
 	}
 
-	const PckItem& GetItem() const noexcept
+	// 文件在索引表中的序号，提交事务期间序号不变
+	uint32_t GetIndex() const noexcept
 	{
-		return m_item;
+		return m_index;
 	}
 
 	virtual const std::vector<uint8_t>& GetData() = 0;
 	uint32_t GetDataSize() { return GetData().size(); }
-	const std::vector<uint8_t>& GetCompressData(int level = Z_DEFAULT_COMPRESSION)
+	const std::vector<uint8_t>& GetCompressData()
 	{
-		if (GetDataSize() < PCK_BEGINCOMPRESS_SIZE)
-		{
-			return GetData();
-		}
+		return Compress(GetData(), m_filename);
+	}
 
-		if (m_compressdata.empty())
-		{
-			auto& data = GetData();
-			auto len = compressBound(data.size());
-			m_compressdata.resize(len);
-			auto ret = compress2(m_compressdata.data(), &len, data.data(), data.size(), level);
-			if (ret != Z_OK)
-			{
-				throw std::runtime_error("压缩数据失败");
-			}
-			m_compressdata.resize(len);
-		}
-		return m_compressdata;
+	virtual size_t Prepare() override
+	{
+		return PrepareData(GetData(), m_filename);
 	}
 
 	virtual void Release() override
 	{
-		std::vector<uint8_t>().swap(m_compressdata);
+		std::string().swap(m_filename);
+		ReleaseCompressData();
 	}
 
 private:
-	const PckItem& m_item;
-	std::vector<uint8_t> m_compressdata;
+	uint32_t m_index;
+	// 用于按扩展名选择压缩等级
+	std::string m_filename;
 };
 
 class PckPendingItem_UpdateBuffer : public PckPendingItem_Update
 {
 public:
-	PckPendingItem_UpdateBuffer(const PckItem& item, const void* buf, uint32_t len)
-		: PckPendingItem_Update(item)
+	PckPendingItem_UpdateBuffer(const PckItem& item, const void* buf, uint32_t len, PolicyPtr policy = nullptr)
+		: PckPendingItem_Update(item, std::move(policy))
 		, m_data((uint8_t*)buf, (uint8_t*)buf + len)
 	{
 	}
@@ -312,6 +437,11 @@ public:
 		return m_data;
 	}
 
+	virtual uint64_t PeekDataSize() override
+	{
+		return m_data.size();
+	}
+
 	virtual void Release() override
 	{
 		PckPendingItem_Update::Release();
@@ -325,8 +455,8 @@ private:
 class PckPendingItem_UpdateFile : public PckPendingItem_Update
 {
 public:
-	PckPendingItem_UpdateFile(const PckItem& item, const std::string& filename)
-		: PckPendingItem_Update(item)
+	PckPendingItem_UpdateFile(const PckItem& item, const std::string& filename, PolicyPtr policy = nullptr)
+		: PckPendingItem_Update(item, std::move(policy))
 		, m_filename(filename)
 	{
 	}
@@ -352,6 +482,11 @@ public:
 		return m_data;
 	}
 
+	virtual uint64_t PeekDataSize() override
+	{
+		return m_data.empty() ? MyGetFileSize(m_filename.c_str()) : m_data.size();
+	}
+
 	virtual void Release() override
 	{
 		PckPendingItem_Update::Release();
@@ -0,0 +1,148 @@
+﻿#include "pckreader.h"
+#include "pckfile.h"
+#include "pckitem.h"
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+
+#pragma region PckItemReader
+
+class PckItemReader::Impl
+{
+public:
+	Impl(PckFile& pck, const PckItem& item, uint32_t buffersize)
+		: m_pck(pck), m_item(item), m_datasize(item.GetDataSize()), m_compresssize(item.GetCompressDataSize()),
+		m_buf(std::max<uint32_t>(buffersize, 1))
+	{
+		if (inflateInit(&m_stream) != Z_OK)
+		{
+			throw std::runtime_error("初始化解压器失败");
+		}
+	}
+
+	~Impl()
+	{
+		inflateEnd(&m_stream);
+	}
+
+	size_t Read(void* buf, size_t n);
+
+	PckFile& m_pck;
+	PckItem m_item;
+	uint32_t m_datasize;
+	uint32_t m_compresssize;
+	// 已经从文件中读取的压缩数据大小
+	uint32_t m_inpos = 0;
+	// 已经输出的数据大小
+	uint64_t m_outpos = 0;
+	// 数据未压缩，直接读取
+	bool m_raw = false;
+	std::vector<uint8_t> m_buf;
+	z_stream m_stream {};
+};
+
+size_t PckItemReader::Impl::Read(void* buf, size_t n)
+{
+	n = (size_t)std::min<uint64_t>(n, m_datasize - m_outpos);
+	if (n == 0)
+	{
+		return 0;
+	}
+	if (m_raw)
+	{
+		auto len = m_pck.GetSingleFileCompressData(m_item, (uint32_t)m_outpos, std::span<uint8_t>((uint8_t*)buf, n));
+		m_outpos += len;
+		return len;
+	}
+
+	m_stream.next_out = (Bytef*)buf;
+	m_stream.avail_out = (uInt)n;
+	while (m_stream.avail_out > 0)
+	{
+		if (m_stream.avail_in == 0 && m_inpos < m_compresssize)
+		{
+			auto len = m_pck.GetSingleFileCompressData(m_item, m_inpos, m_buf);
+			m_inpos += len;
+			m_stream.next_in = m_buf.data();
+			m_stream.avail_in = len;
+		}
+		auto ret = inflate(&m_stream, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+		{
+			break;
+		}
+		if (ret != Z_OK)
+		{
+			// 与GetSingleFileData一致：解压失败且数据大小相同时，认为数据未压缩
+			if (m_outpos == 0 && m_compresssize == m_datasize)
+			{
+				m_raw = true;
+				return Read(buf, n);
+			}
+			throw std::runtime_error("解压数据失败");
+		}
+	}
+	auto len = n - m_stream.avail_out;
+	if (len == 0)
+	{
+		// 压缩数据已经结束，但解压后的数据比索引中记录的少
+		throw std::runtime_error("解压数据失败");
+	}
+	m_outpos += len;
+	return len;
+}
+
+PckItemReader::PckItemReader(PckFile& pck, const PckItem& item, uint32_t buffersize)
+	: pImpl(new Impl(pck, item, buffersize))
+{
+}
+
+PckItemReader::~PckItemReader()
+{
+}
+
+size_t PckItemReader::Read(void* buf, size_t n)
+{
+	return pImpl->Read(buf, n);
+}
+
+uint64_t PckItemReader::Size() const noexcept
+{
+	return pImpl->m_datasize;
+}
+
+uint64_t PckItemReader::Tell() const noexcept
+{
+	return pImpl->m_outpos;
+}
+
+bool PckItemReader::Eof() const noexcept
+{
+	return pImpl->m_outpos >= pImpl->m_datasize;
+}
+
+#pragma endregion
+
+#pragma region PckItemStreamBuf
+
+PckItemStreamBuf::PckItemStreamBuf(PckFile& pck, const PckItem& item, uint32_t buffersize)
+	: m_reader(pck, item), m_buf(std::max<uint32_t>(buffersize, 1))
+{
+}
+
+PckItemStreamBuf::int_type PckItemStreamBuf::underflow()
+{
+	if (gptr() < egptr())
+	{
+		return traits_type::to_int_type(*gptr());
+	}
+	auto len = m_reader.Read(m_buf.data(), m_buf.size());
+	if (len == 0)
+	{
+		return traits_type::eof();
+	}
+	setg(m_buf.data(), m_buf.data(), m_buf.data() + len);
+	return traits_type::to_int_type(*gptr());
+}
+
+#pragma endregion
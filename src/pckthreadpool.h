@@ -0,0 +1,95 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// 固定线程数的线程池，任务按提交顺序执行
+// 析构时会先执行完所有已提交的任务
+class PckThreadPool
+{
+public:
+	// nthread为0时使用CPU线程数
+	explicit PckThreadPool(size_t nthread = 0)
+	{
+		if (nthread == 0)
+		{
+			nthread = std::thread::hardware_concurrency();
+		}
+		if (nthread == 0)
+		{
+			nthread = 1;
+		}
+		for (size_t i = 0; i < nthread; ++i)
+		{
+			m_threads.emplace_back([this] { _run(); });
+		}
+	}
+
+	~PckThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		for (auto& t : m_threads)
+		{
+			t.join();
+		}
+	}
+
+	// 提交任务，任务中抛出的异常会被忽略，需要任务自己处理
+	void Post(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+		}
+		m_cond.notify_one();
+	}
+
+	size_t Size() const noexcept
+	{
+		return m_threads.size();
+	}
+
+private:
+	PckThreadPool(const PckThreadPool&) = delete;
+	void operator=(const PckThreadPool&) = delete;
+
+	void _run()
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+				if (m_tasks.empty())
+				{
+					return;
+				}
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+			try
+			{
+				task();
+			}
+			catch (...)
+			{
+			}
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop = false;
+};